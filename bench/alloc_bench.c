@@ -0,0 +1,62 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "con_term.h"
+#include "con_alloc.h"
+
+// Times allocating into the old generation while the heap grows to the
+// given number of cells, and again once all of them have been swept and
+// the arenas are reused. Without safepoints the nursery fills up after
+// its first few thousand cells, so nearly everything here goes through
+// arena_pool_alloc.
+
+double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+double fill(con_term_t** list, size_t cells) {
+    // The car is a singleton, so that each cell is a single term
+    con_term_t* t = con_alloc_true();
+    double start = now_ms();
+    for (size_t i = 0; i < cells; i++) {
+        *list = cons(t, *list);
+    }
+    return now_ms() - start;
+}
+
+void bench_alloc(size_t cells) {
+    con_term_t* list = con_alloc_empty_list();
+    con_root(&list);
+
+    double grow = fill(&list, cells);
+    // Drop the whole list, so the second fill only reuses swept arenas
+    list = con_alloc_empty_list();
+    con_gc_major();
+    double reuse = fill(&list, cells);
+
+    printf("%10zu cells: grow %6.2f ns/cell, reuse %6.2f ns/cell\n",
+        cells, grow * 1e6 / cells, reuse * 1e6 / cells);
+
+    con_unroot(&list);
+    con_gc_major();
+}
+
+int main(int argc, char** argv) {
+    size_t sizes[] = {10000, 100000, 1000000, 10000000, 100000000};
+    size_t n = sizeof(sizes) / sizeof(*sizes);
+
+    con_alloc_init();
+    if (argc > 1) {
+        bench_alloc(strtoul(argv[1], NULL, 10));
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            bench_alloc(sizes[i]);
+        }
+    }
+    con_alloc_deinit();
+    return 0;
+}
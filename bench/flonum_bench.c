@@ -0,0 +1,92 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "con_term.h"
+#include "con_alloc.h"
+
+// Times two numeric kernels the way eval runs them, with a safepoint
+// after every operation: a recurrence which makes a new flonum per step
+// and keeps only the last, and summing a list of flonums which is kept
+// live. Build with and without NAN_BOXING=1 to compare the layouts.
+
+#define RUNS 5
+
+double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+double recurrence(size_t steps) {
+    con_term_t* x = con_alloc_flonum(1.0);
+    con_root(&x);
+    for (size_t i = 0; i < steps; i++) {
+        x = con_alloc_flonum(con_flonum_value(x) * 0.999999 + 0.5);
+        con_gc();
+    }
+    con_unroot(&x);
+    return con_flonum_value(x);
+}
+
+void bench_flonum(size_t n) {
+    con_gc_stats_t before, after;
+    double best = 0, result = 0;
+
+    con_gc_stats(&before);
+    for (int run = 0; run < RUNS; run++) {
+        double start = now_ms();
+        result += recurrence(n);
+        double ms = now_ms() - start;
+        if (run == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    con_gc_stats(&after);
+    printf("%10zu steps: recurrence %6.2f ns/step, %zu minor gcs",
+        n, best * 1e6 / n, (after.minor_collections - before.minor_collections) / RUNS);
+
+    con_term_t* list = con_alloc_empty_list();
+    con_root(&list);
+    for (size_t i = 0; i < n; i++) {
+        list = cons(con_alloc_flonum(i * 0.5), list);
+        con_gc();
+    }
+    con_gc_major();
+    for (int run = 0; run < RUNS; run++) {
+        double start = now_ms();
+        double sum = 0;
+        for (con_term_t* t = list; CON_IS_PAIR(t); t = CDR(t)) {
+            sum += con_flonum_value(CAR(t));
+        }
+        double ms = now_ms() - start;
+        if (run == 0 || ms < best) {
+            best = ms;
+        }
+        result += sum;
+    }
+    con_gc_stats(&after);
+    printf(", sum %6.2f ns/cell, %zu arenas live\n", best * 1e6 / n, after.arenas);
+    if (result < 0) {
+        puts("unreachable");
+    }
+    con_unroot(&list);
+    con_gc_major();
+}
+
+int main(int argc, char** argv) {
+    size_t sizes[] = {100000, 1000000, 10000000};
+    size_t n = sizeof(sizes) / sizeof(*sizes);
+
+    con_alloc_init();
+    if (argc > 1) {
+        bench_flonum(strtoul(argv[1], NULL, 10));
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            bench_flonum(sizes[i]);
+        }
+    }
+    con_alloc_deinit();
+    return 0;
+}
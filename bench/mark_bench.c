@@ -0,0 +1,64 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "con_term.h"
+#include "con_alloc.h"
+
+// Times marking a heap that holds one long list, which used to blow
+// the C stack somewhere short of a million cells.
+
+#define RUNS 5
+
+double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+void bench_mark(size_t cells) {
+    con_term_t* list = con_alloc_empty_list();
+    con_root(&list);
+    for (size_t i = 0; i < cells; i++) {
+        // Fixnums are immediate, a flonum is the smallest heap term
+        con_term_t* n = con_alloc(FLONUM);
+        n->value.flonum = i;
+        list = cons(n, list);
+    }
+    // Promote everything, so that only the old generation is marked
+    con_gc_major();
+
+    double best = 0;
+    for (int i = 0; i < RUNS; i++) {
+        double start = now_ms();
+        trace(list);
+        double ms = now_ms() - start;
+        if (i == 0 || ms < best) {
+            best = ms;
+        }
+        // Sweeping clears the marks again
+        con_gc_major();
+    }
+    printf("%10zu cells: %9.2f ms, %6.2f ns/cell\n",
+        cells, best, best * 1e6 / cells);
+
+    con_unroot(&list);
+    con_gc_major();
+}
+
+int main(int argc, char** argv) {
+    size_t sizes[] = {1000000, 3000000, 10000000};
+    size_t n = sizeof(sizes) / sizeof(*sizes);
+
+    con_alloc_init();
+    if (argc > 1) {
+        bench_mark(strtoul(argv[1], NULL, 10));
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            bench_mark(sizes[i]);
+        }
+    }
+    con_alloc_deinit();
+    return 0;
+}
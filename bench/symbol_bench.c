@@ -0,0 +1,82 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "con_term.h"
+#include "con_alloc.h"
+
+// Times interning fresh symbols and looking up ones which exist already,
+// then drops them all and interns a new batch a few times over, to show
+// whether the symbols of earlier batches are given back.
+
+#define RUNS 5
+#define BATCHES 4
+
+double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+char** make_names(size_t n, int batch) {
+    char** names = malloc(n * sizeof(*names));
+    for (size_t i = 0; i < n; i++) {
+        names[i] = malloc(32);
+        snprintf(names[i], 32, "symbol-%d-%zu", batch, i);
+    }
+    return names;
+}
+
+void free_names(char** names, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+void bench_symbols(size_t n) {
+    double create = 0, lookup = 0;
+    con_gc_stats_t s;
+
+    for (int batch = 0; batch < BATCHES; batch++) {
+        char** names = make_names(n, batch);
+        double start = now_ms();
+        for (size_t i = 0; i < n; i++) {
+            con_alloc_sym(names[i]);
+        }
+        create = now_ms() - start;
+        for (int run = 0; run < RUNS; run++) {
+            start = now_ms();
+            for (size_t i = 0; i < n; i++) {
+                con_alloc_sym(names[i]);
+            }
+            double ms = now_ms() - start;
+            if (run == 0 || ms < lookup) {
+                lookup = ms;
+            }
+        }
+        free_names(names, n);
+        // Nothing refers to the batch any more
+        con_gc_major();
+        con_gc_stats(&s);
+        printf("%10zu symbols, batch %d: create %6.2f ns/symbol, lookup %6.2f ns/symbol, "
+            "%zu arenas after gc\n", n, batch, create * 1e6 / n, lookup * 1e6 / n, s.arenas);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t sizes[] = {10000, 100000, 1000000};
+    size_t n = sizeof(sizes) / sizeof(*sizes);
+
+    con_alloc_init();
+    if (argc > 1) {
+        bench_symbols(strtoul(argv[1], NULL, 10));
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            bench_symbols(sizes[i]);
+        }
+    }
+    con_alloc_deinit();
+    return 0;
+}
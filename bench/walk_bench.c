@@ -0,0 +1,87 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "con_term.h"
+#include "con_alloc.h"
+
+// Times walking lists whose cells were allocated interleaved with each
+// other, before and after a compaction has made their spines contiguous.
+
+#define RUNS 5
+#define LISTS 16
+
+double now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+double walk(con_term_t* lists) {
+    double best = 0;
+    for (int i = 0; i < RUNS; i++) {
+        long sum = 0;
+        double start = now_ms();
+        CON_LIST_FOREACH(list, lists) {
+            for (con_term_t* t = list; CON_IS_PAIR(t); t = CDR(t)) {
+                sum += CAR(t)->value.flonum;
+            }
+        }
+        double ms = now_ms() - start;
+        if (i == 0 || ms < best) {
+            best = ms;
+        }
+        if (sum < 0) {
+            puts("unreachable");
+        }
+    }
+    return best;
+}
+
+void bench_walk(size_t cells) {
+    con_term_t* lists = con_alloc_empty_list();
+    con_root(&lists);
+    for (int i = 0; i < LISTS; i++) {
+        lists = cons(con_alloc_empty_list(), lists);
+    }
+    // Add every cell to a random list, so that neighbouring cells belong
+    // to different lists
+    srand(1);
+    for (size_t i = 0; i < cells; i++) {
+        // Fixnums are immediate, a flonum is the smallest heap term
+        con_term_t* n = con_alloc(FLONUM);
+        n->value.flonum = i;
+        con_term_t* entry = lists;
+        for (int j = rand() % LISTS; j > 0; j--) {
+            entry = CDR(entry);
+        }
+        SET_CAR(entry, cons(n, CAR(entry)));
+    }
+    con_gc_major();
+    double before = walk(lists);
+    con_gc_compact();
+    double after = walk(lists);
+
+    printf("%10zu cells: %6.2f ns/cell before, %6.2f ns/cell compacted\n",
+        cells, before * 1e6 / cells, after * 1e6 / cells);
+
+    con_unroot(&lists);
+    con_gc_major();
+}
+
+int main(int argc, char** argv) {
+    size_t sizes[] = {100000, 1000000, 10000000};
+    size_t n = sizeof(sizes) / sizeof(*sizes);
+
+    con_alloc_init();
+    if (argc > 1) {
+        bench_walk(strtoul(argv[1], NULL, 10));
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            bench_walk(sizes[i]);
+        }
+    }
+    con_alloc_deinit();
+    return 0;
+}
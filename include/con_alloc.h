@@ -1,19 +1,125 @@
 #ifndef CON_ALLOC_H
 #define CON_ALLOC_H
 
-struct con_term_t;
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "con_term.h"
+
+#define CON_GC_PAUSE_BUCKETS 32
+
+typedef struct {
+    size_t minor_collections;
+    // Incremental cycles included
+    size_t major_collections;
+    size_t compactions;
+    // Every safepoint which did any collecting is one pause
+    size_t pauses;
+    double pause_total_usec;
+    double pause_max_usec;
+    // Pauses shorter than 2^i microseconds, which did not fit a lower bucket
+    size_t pause_histogram[CON_GC_PAUSE_BUCKETS];
+    size_t allocated[CON_NUM_TYPES];
+    size_t bytes_allocated[CON_NUM_TYPES];
+    // Old terms which survived the last major gc
+    size_t live_objects;
+    // Finalizers which have run
+    size_t finalized;
+    // Guarded evaluations which went over a quota
+    size_t evals_abandoned;
+    size_t arenas;
+    // Held by terms outside the arenas, see con_gc_external_alloc
+    size_t external_bytes;
+} con_gc_stats_t;
+
+// Called on a copy of a dead term, which is no longer in the heap
+typedef void (*con_finalizer)(struct con_term_t*);
 
 void   con_alloc_init();
 void   con_alloc_deinit();
 
 struct con_term_t* con_alloc(int);
 struct con_term_t* con_alloc_sym(char*);
+struct con_term_t* con_alloc_flonum(double);
+// A fixnum, or a flonum if n does not fit in one
+struct con_term_t* con_alloc_fixnum(long);
 struct con_term_t* con_alloc_true();
 struct con_term_t* con_alloc_false();
+struct con_term_t* con_alloc_empty_list();
+struct con_term_t* con_alloc_cons(struct con_term_t*, struct con_term_t*);
+// A list of the two
 struct con_term_t* con_alloc_pair(struct con_term_t*, struct con_term_t*);
 struct con_term_t* con_alloc_env(struct con_term_t*);
+struct con_term_t* con_alloc_weak_box(struct con_term_t*);
+struct con_term_t* con_alloc_ephemeron_table();
+struct con_term_t* con_ephemeron_ref(struct con_term_t*, struct con_term_t*);
+void   con_ephemeron_set(struct con_term_t*, struct con_term_t*, struct con_term_t*);
+
+// Rooted slots are kept on a shadow stack, so they have to be unrooted
+// in the opposite order. Debug builds check that they are.
+extern struct con_term_t*** con_roots;
+extern size_t con_roots_size;
+extern size_t con_roots_capacity;
+
+void   con_roots_grow();
 
+#ifdef GC_DEBUG
 void   con_root(struct con_term_t**);
 void   con_unroot(struct con_term_t**);
+#else
+static inline void con_root(struct con_term_t** t) {
+    if (con_roots_size == con_roots_capacity) {
+        con_roots_grow();
+    }
+    con_roots[con_roots_size++] = t;
+}
+
+static inline void con_unroot(struct con_term_t** t) {
+    con_roots_size--;
+}
+#endif
+
 void   con_gc();
+void   con_gc_major();
+void   con_gc_compact();
+void   con_gc_set_growth_factor(double);
+void   con_gc_set_min_trigger(size_t);
+void   con_gc_set_retain_bytes(size_t);
+void   con_gc_set_pause_budget(long);
+void   con_gc_set_lazy_sweep(int);
+void   con_gc_set_background_sweep(int);
+void   con_gc_set_compacting(int);
+void   con_gc_set_conservative(int);
+void   con_gc_set_heap_limit(size_t);
+void   con_gc_set_eval_budget(size_t);
+// Off (1) by default. Parallel marking has only been measured on a
+// single core, where it is about twice as slow, so its scaling is not
+// validated yet, see bench/par_mark_bench.c.
+void   con_gc_set_mark_threads(int);
+// Memory a term holds outside the heap, like an environment's table. It
+// counts against the heap limit and the eval budget until it is freed,
+// by the term's finalizer.
+void   con_gc_external_alloc(size_t);
+void   con_gc_external_free(size_t);
+void   con_gc_stats(con_gc_stats_t*);
+double con_gc_pause_percentile(con_gc_stats_t*, double);
+// Only terms allocated after a finalizer is set are finalized
+void   con_gc_set_finalizer(int, con_finalizer);
+void   con_gc_run_finalizers();
+
+// The operator of the form being evaluated, if it is a symbol, which
+// the heap profiler records as the site of sampled allocations
+extern struct con_term_t* con_alloc_site;
+
+// Evaluations between these two are guarded by the heap limit and the
+// allocation budget. If either is exceeded, the evaluation is abandoned
+// by a longjmp back to the jmp_buf with the shadow stack unwound to
+// where it was at con_eval_begin, after printing an error.
+void   con_eval_begin(jmp_buf*);
+void   con_eval_end();
+
+void   con_heap_profile(size_t);
+size_t con_heap_dump(FILE*);
+void   con_write_barrier(struct con_term_t*, struct con_term_t*);
 #endif // CON_ALLOC_H
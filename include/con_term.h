@@ -1,5 +1,6 @@
 #ifndef CON_TERM_H
 #define CON_TERM_H
+#include <stdint.h>
 #include <stdlib.h>
 
 typedef enum CON_TYPE {
@@ -13,61 +14,200 @@ typedef enum CON_TYPE {
     CON_FALSE,
     ENVIRONMENT,
     UNDEFINED,
-    LAMBDA
+    LAMBDA,
+    WEAK_BOX,
+    EPHEMERON_TABLE,
+    FORWARDED
 } CON_TYPE;
 
+#define CON_NUM_TYPES (FORWARDED + 1)
+
 typedef struct con_term_t* (*con_builtin)(struct con_term_t*);
 
 struct _GHashTable;
+struct string_chunk;
 
 typedef struct con_term_t {
     CON_TYPE type;
-    int mark:1;
+    // Where the heap profiler sampled the term being allocated, or 0
+    unsigned int site:24;
     union {
-        long fixnum;
         double flonum;
         con_builtin builtin;
         struct {
             struct _GHashTable* table;
             struct con_term_t* parent;
         } env;
-        struct {
-            struct con_term_t* car;
-            struct con_term_t* cdr;
-            size_t length;
-        } list;
         struct {
             char* str;
-            size_t size;
+            unsigned int size;
+            // Hashed once when interned, for the intern table and
+            // environments
+            unsigned int hash;
+            struct string_chunk* chunk;
         } sym;
         struct {
             struct con_term_t* parent_env;
             struct con_term_t* vars;
             struct con_term_t* body;
         } lambda;
+        // Cleared by the collector once the value is unreachable
+        struct con_term_t* weak;
+        // Keys to values, where a value is only kept alive by the table
+        // for as long as its key is reachable from elsewhere
+        struct _GHashTable* ephemerons;
+        // Where a FORWARDED term was copied to
+        struct con_term_t* forward;
     } value;
 } con_term_t;
 
+// A reference held by a pair. Built with CON_COMPRESSED_REFS, it is the
+// low 32 bits of the term pointer, and every term lives in a heap
+// reservation aligned to 4 GiB, see con_decompress.
+#ifdef CON_COMPRESSED_REFS
+typedef uint32_t con_ref;
+extern char* con_heap_base;
+#else
+typedef struct con_term_t* con_ref;
+#endif
+
+// Cons cells are only a car and a cdr. They have no room for a type, so
+// references to them are tagged instead, see CON_IS_PAIR.
+typedef struct con_pair {
+    // Tagged references need pairs 8 byte aligned, even when compressed
+    _Alignas(8) con_ref car;
+    con_ref cdr;
+} con_pair;
+
 void                con_env_init(con_term_t*, con_term_t* parent);
 void                con_env_deinit(con_term_t*);
 struct con_term_t*  con_env_lookup(con_term_t*, struct con_term_t*);
 int                 con_env_bind(con_term_t*, struct con_term_t*, struct con_term_t*);
 void                con_env_add_builtins(con_term_t*);
 
+char*               con_type_name(CON_TYPE);
 void                con_term_print(con_term_t*);
 void                con_term_print_message(char*, con_term_t*);
 
 con_term_t*         cons(con_term_t*, con_term_t*);
+size_t              con_list_length(con_term_t*);
+
+// Fixnums, booleans and the empty list are never allocated, they are
+// kept in the term pointer itself. Terms are at least 8 byte aligned, so
+// the low bits tell them apart: xx1 is a fixnum shifted left by one, and
+// 010 is a constant with its type in the bits above. 100 is a pointer to
+// a pair, 4 bytes past it, and 000 a pointer to any other term.
+//
+// Built with CON_NAN_BOXING, flonums are immediate as well, and the top
+// 16 bits are used instead for numbers, which pointers leave clear.
+// 0xffff is a 48 bit fixnum, and anything else but 0 is a double with
+// 2^49 added to its bits. With NaNs made canonical, that never carries
+// into the fixnum tag or wraps around to 0. Arithmetic which leaves the
+// 48 bits gives a flonum, see CON_FIXNUM_FITS.
+#if defined(CON_NAN_BOXING) && defined(CON_COMPRESSED_REFS)
+#error "NaN-boxed terms do not fit in a compressed reference"
+#endif
+
+#define CON_TAG_FIXNUM 1
+#define CON_TAG_CONST  2
+#define CON_TAG_PAIR   4
+#define CON_TAG_MASK   7
+
+#ifdef CON_NAN_BOXING
+#define CON_TAG_NUMBER_SHIFT 48
+#define CON_TAG_NUMBER_FIXNUM 0xffff
+#define CON_DOUBLE_OFFSET ((uint64_t)1 << 49)
+
+#define CON_NUMBER_TAG(t) ((uint64_t)(uintptr_t)(t) >> CON_TAG_NUMBER_SHIFT)
+#define CON_IS_IMMEDIATE(t) (CON_NUMBER_TAG(t) != 0 || ((uintptr_t)(t) & CON_TAG_CONST) != 0)
+#define CON_IS_FIXNUM(t) (CON_NUMBER_TAG(t) == CON_TAG_NUMBER_FIXNUM)
+#define CON_IS_FLONUM(t) (CON_NUMBER_TAG(t) != 0 && !CON_IS_FIXNUM(t))
+#define CON_IS_PAIR(t) (CON_NUMBER_TAG(t) == 0 && ((uintptr_t)(t) & CON_TAG_MASK) == CON_TAG_PAIR)
+#define CON_FIXNUM_MASK (((uint64_t)1 << CON_TAG_NUMBER_SHIFT) - 1)
+#define CON_FIXNUM(n) ((con_term_t*)(uintptr_t)(~CON_FIXNUM_MASK | ((uint64_t)(n) & CON_FIXNUM_MASK)))
+#define CON_FIXNUM_VALUE(t) \
+    ((long)((int64_t)((uint64_t)(uintptr_t)(t) << (64 - CON_TAG_NUMBER_SHIFT)) >> (64 - CON_TAG_NUMBER_SHIFT)))
+#else
+#define CON_IS_IMMEDIATE(t) (((uintptr_t)(t) & 3) != 0)
+#define CON_IS_FIXNUM(t) (((uintptr_t)(t) & CON_TAG_FIXNUM) != 0)
+#define CON_IS_PAIR(t) (((uintptr_t)(t) & CON_TAG_MASK) == CON_TAG_PAIR)
+#ifdef CON_COMPRESSED_REFS
+// Fixnums have to fit in a compressed reference, so they are 31 bits
+#define CON_FIXNUM(n) ((con_term_t*)(intptr_t)(int32_t)(((uint32_t)(n) << 1) | CON_TAG_FIXNUM))
+#else
+#define CON_FIXNUM(n) ((con_term_t*)(((uintptr_t)(n) << 1) | CON_TAG_FIXNUM))
+#endif
+#define CON_FIXNUM_VALUE(t) ((long)((intptr_t)(t) >> 1))
+#endif
+// Whether n survives being made a fixnum, in whichever width they are
+#define CON_FIXNUM_FITS(n) (CON_FIXNUM_VALUE(CON_FIXNUM(n)) == (n))
+#define CON_PAIR(t) ((con_pair*)((uintptr_t)(t) - CON_TAG_PAIR))
+#define CON_PAIR_TERM(p) ((con_term_t*)((uintptr_t)(p) + CON_TAG_PAIR))
+#define CON_CONST(type) ((con_term_t*)(((uintptr_t)(type) << 3) | CON_TAG_CONST))
+
+// The type of any term, immediate or not
+static inline CON_TYPE con_type_of(con_term_t* t) {
+    if (CON_IS_FIXNUM(t)) {
+        return FIXNUM;
+#ifdef CON_NAN_BOXING
+    } else if (CON_IS_FLONUM(t)) {
+        return FLONUM;
+#endif
+    } else if (CON_IS_PAIR(t)) {
+        return LIST;
+    } else if (CON_IS_IMMEDIATE(t)) {
+        return (CON_TYPE)((uintptr_t)t >> 3);
+    }
+    return t->type;
+}
 void                trace(con_term_t*);
 
-#define CAR(t) ((t)->value.list.car)
-#define CDR(t) ((t)->value.list.cdr)
+#ifdef CON_NAN_BOXING
+static inline con_term_t* con_box_flonum(double d) {
+    union { double d; uint64_t bits; } u = {d};
+    if (d != d) {
+        u.bits = 0x7ff8000000000000;
+    }
+    return (con_term_t*)(uintptr_t)(u.bits + CON_DOUBLE_OFFSET);
+}
+#endif
+
+static inline double con_flonum_value(con_term_t* t) {
+#ifdef CON_NAN_BOXING
+    union { uint64_t bits; double d; } u = {(uint64_t)(uintptr_t)t - CON_DOUBLE_OFFSET};
+    return u.d;
+#else
+    return t->value.flonum;
+#endif
+}
+
+#ifdef CON_COMPRESSED_REFS
+static inline con_ref con_compress(con_term_t* t) {
+    return (con_ref)(uintptr_t)t;
+}
+
+static inline con_term_t* con_decompress(con_ref r) {
+    // Fixnums are sign extended, constants are small enough that it
+    // makes no difference
+    uintptr_t immediate = (uintptr_t)(intptr_t)(int32_t)r;
+    uintptr_t term = (uintptr_t)con_heap_base + r;
+    return (con_term_t*)(CON_IS_IMMEDIATE(r) || !r ? immediate : term);
+}
+#else
+#define con_compress(t) (t)
+#define con_decompress(r) (r)
+#endif
+
+#define CAR(t) (con_decompress(CON_PAIR(t)->car))
+#define CDR(t) (con_decompress(CON_PAIR(t)->cdr))
+#define SET_CAR(t, v) (CON_PAIR(t)->car = con_compress(v))
+#define SET_CDR(t, v) (CON_PAIR(t)->cdr = con_compress(v))
 #define CADR(t) (CAR(CDR(t)))
 #define CADDR(t) (CAR(CDR(CDR(t))))
 
 #define CON_LIST_FOREACH(I, L) \
-    for (con_term_t *__list_iter__ = (L), *I = CAR(L);\
-    __list_iter__->type != EMPTY_LIST;\
-    __list_iter__ = CDR(__list_iter__), I = CAR(__list_iter__))
+    for (con_term_t *__list_iter__ = (L), *I = NULL;\
+    CON_IS_PAIR(__list_iter__) && ((I = CAR(__list_iter__)), 1);\
+    __list_iter__ = CDR(__list_iter__))
 
 #endif /* end of include guard:  */
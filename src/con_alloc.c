@@ -1,5 +1,12 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 #include <glib-2.0/glib.h>
 
@@ -7,87 +14,445 @@
 #include "con_term.h"
 
 #define POOL_SIZE 1000
-#define POOL_ARENA_SIZE 1000
+// Empty arenas kept around for reuse after a sweep by each pool, the
+// rest are unmapped. Can be overridden by CON_GC_RETAIN_BYTES.
+#define GC_RETAIN_BYTES (4 * 1024 * 1024)
+#define NURSERY_BYTES (2 * 1024 * 1024)
 
 #ifdef GC_DEBUG
-#define INIT_GC_ALLOC_TRIGGER 1
-#define GC_ALLOC_TRIGGER 1
+#define GC_MIN_TRIGGER 1
+#define GC_GROWTH_FACTOR 1.0
+#define NURSERY_TRIGGER 1
+#define GC_STEP_TRIGGER 1
 #else
-#define INIT_GC_ALLOC_TRIGGER 500
-#define GC_ALLOC_TRIGGER 100
+// A major gc is due once the old generation has grown by GC_GROWTH_FACTOR
+// over what survived the last one, and by at least GC_MIN_TRIGGER terms,
+// so the cost of marking is spread over as many allocations as survived.
+#define GC_MIN_TRIGGER 10000
+#define GC_GROWTH_FACTOR 2.0
+// Collections only happen at safepoints in eval, so leave some room
+// in the nursery for whatever gets allocated until the next one.
+#define NURSERY_TRIGGER (NURSERY_BYTES / 4 * 3)
+// Allocations between two increments of an incremental collection
+#define GC_STEP_TRIGGER 1000
 #endif
 
-// Needed for garbage collection
+// Finalizers run at a safepoint, after any collecting it did
+#define FINALIZE_BATCH 64
+
+// How many terms an incremental step marks between looking at the clock
+#define GC_STEP_CHECK 64
+// Grey terms a mark worker keeps to itself before sharing half of them
+#define MARK_SHARE_THRESHOLD 64
+
+// Needed for garbage collection. Only allocations into the old
+// generation (promotions and nursery overflow) count towards a major gc.
 static size_t allocations_since_gc = 0;
-static int initial_gc = 0;
+// The same allocations in bytes, and the bytes which survived the last
+// major gc, which the heap limit is checked against
+static size_t bytes_since_gc = 0;
+static size_t live_bytes = 0;
+static size_t gc_trigger = GC_MIN_TRIGGER;
+// Both can be overridden by CON_GC_MIN_TRIGGER and CON_GC_GROWTH_FACTOR
+static size_t gc_min_trigger = GC_MIN_TRIGGER;
+static double gc_growth_factor = GC_GROWTH_FACTOR;
+static size_t gc_retain_bytes = GC_RETAIN_BYTES;
 
-// Symbol table and singletons
-static GHashTable* con_symbols = NULL;
-static con_term_t *con_true = NULL, *con_false = NULL;
+// Counters for con_gc_stats. Pause times are kept in nanoseconds.
+static con_gc_stats_t stats = {0};
+static long pause_total_nsec = 0;
+static long pause_max_nsec = 0;
 
-typedef struct {
-    con_term_t* contents;
-    size_t* free;
-    size_t capacity;
+// Incremental collection. With a pause budget of zero every major gc
+// runs to completion, otherwise marking and sweeping are done in steps
+// of at most pause_budget microseconds interleaved with eval.
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING
+} gc_phase;
+
+static gc_phase phase = GC_IDLE;
+static long pause_budget = 0;
+static size_t allocations_since_step = 0;
+
+// With lazy sweeping arenas are left unswept once marking is done and
+// are swept by arena_pool_alloc as it needs free slots, so the pause no
+// longer grows with the size of the heap.
+static int lazy_sweep = 0;
+// Sweeping is left to a background thread instead, and to the mutator
+// when it runs out of swept arenas before the sweeper gets to them.
+static int background_sweep = 0;
+
+// Major collections copy everything reachable into fresh arenas instead
+// of marking and sweeping, which is never done incrementally.
+static int compacting = 0;
+
+// Conservative stack scanning. Every word on the mutator's stack, and in
+// its registers, which points into an allocated slot of an arena is a
+// root as well as the shadow stack. Such terms cannot be moved, so the
+// nursery is bypassed and compaction turns into an ordinary major gc.
+static int conservative = 0;
+// The end of the mutator's stack, which grows down towards the scan
+static uintptr_t stack_top = 0;
+
+// Arenas are ARENA_BYTES blocks aligned to their own size, with the
+// header at the start, so the arena holding a term is found by masking
+// its address. Which slots are allocated and marked is kept in bitmaps
+// in the header rather than in the terms, so marking never writes to
+// the terms and sweeping only has to look at the bitmaps.
+// An arena holds slots of one size, from whole terms down to pairs, and
+// the bitmaps are sized for pairs.
+#define ARENA_BYTES (64 * 1024)
+#define TERM_SHIFT 5
+#define SMALL_SHIFT 4
+#ifdef CON_COMPRESSED_REFS
+#define ARENA_WORDS 120
+#define PAIR_SHIFT 3
+#else
+#define ARENA_WORDS 62
+#define PAIR_SHIFT 4
+#endif
+
+_Static_assert(sizeof(con_term_t) == 1 << TERM_SHIFT, "terms are not 32 bytes");
+_Static_assert(sizeof(con_pair) == 1 << PAIR_SHIFT, "pairs do not match PAIR_SHIFT");
+_Static_assert(offsetof(con_term_t, value) + sizeof(double) <= 1 << SMALL_SHIFT,
+    "a term with one word of value does not fit a small slot");
+
+typedef struct arena {
     size_t size;
+    // The number of slots, and the log2 of their size
+    size_t capacity;
+    int shift;
+    int needs_sweep;
+    // Every bitmap word before this one is full
+    size_t cursor;
+    // Holds terms which refer to no others
+    int leaf;
+    // Holds pairs, whose slots have no header
+    int pairs;
+    // The next arena in the pool's list of arenas with free slots
+    struct arena* next_free;
+    uint64_t alloc[ARENA_WORDS];
+    uint64_t marks[ARENA_WORDS];
+    // Terms of a type with a finalizer, which are queued for it once
+    // they are found dead
+    uint64_t finalize[ARENA_WORDS];
+    // Slots in the remembered set
+    uint64_t remembered[ARENA_WORDS];
+    char contents[];
 } arena;
 
-arena* arena_init(size_t capacity) {
-    arena* a = calloc(1, sizeof(*a));
-    a->contents = calloc(capacity, sizeof(con_term_t));
-    a->free = calloc(capacity, sizeof(size_t));
-    for(int i = 0; i < capacity; i++) {
-        a->free[i] = i;
-        a->contents[i].mark = 0;
-        a->contents[i].type = UNDEFINED;
-    }
-    a->capacity = capacity;
-    a->size = 0;
+_Static_assert(sizeof(arena) % sizeof(con_pair) == 0, "arena contents are not aligned");
+_Static_assert(sizeof(arena) + 64 * ARENA_WORDS * sizeof(con_pair) <= ARENA_BYTES,
+    "arena contents do not fit in ARENA_BYTES");
+
+// Maps bytes aligned to align, by mapping more and trimming it down
+char* map_aligned(size_t bytes, size_t align, int prot) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (prot == PROT_NONE ? MAP_NORESERVE : 0);
+    char* m = mmap(NULL, bytes + align, prot, flags, -1, 0);
+    if (m == MAP_FAILED) {
+        return NULL;
+    }
+    char* start = (char*)(((uintptr_t)m + align - 1) & ~(uintptr_t)(align - 1));
+    if (start > m) {
+        munmap(m, start - m);
+    }
+    munmap(start + bytes, m + align - start);
+    return start;
+}
+
+#ifdef CON_COMPRESSED_REFS
+// Pairs refer to terms by the low 32 bits of their address, so every
+// arena and the nursery are carved out of one reservation aligned to
+// 4 GiB. Nothing is allocated at its base, so 0 is still NULL. Arenas
+// which are given back have their pages dropped and are reused before
+// the reservation grows.
+#define HEAP_RESERVE ((size_t)1 << 32)
+
+char* con_heap_base = NULL;
+static char* heap_top = NULL;
+static char** heap_free = NULL;
+static size_t heap_free_size = 0;
+static size_t heap_free_capacity = 0;
+// Sweeper threads give arenas back
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void heap_reserve() {
+    con_heap_base = map_aligned(HEAP_RESERVE, HEAP_RESERVE, PROT_NONE);
+    if (!con_heap_base) {
+        puts("FATAL: Could not reserve the heap.");
+        exit(1);
+    }
+    heap_top = con_heap_base + ARENA_BYTES;
+}
+
+void heap_unreserve() {
+    munmap(con_heap_base, HEAP_RESERVE);
+    free(heap_free);
+    con_heap_base = heap_top = NULL;
+    heap_free = NULL;
+    heap_free_size = heap_free_capacity = 0;
+}
+
+// Zero filled, and aligned to ARENA_BYTES
+char* heap_carve(size_t bytes) {
+    char* m = NULL;
+    bytes = (bytes + ARENA_BYTES - 1) & ~(size_t)(ARENA_BYTES - 1);
+    pthread_mutex_lock(&heap_lock);
+    if (bytes == ARENA_BYTES && heap_free_size) {
+        m = heap_free[--heap_free_size];
+    } else if ((size_t)(con_heap_base + HEAP_RESERVE - heap_top) >= bytes) {
+        m = heap_top;
+        heap_top += bytes;
+        if (mprotect(m, bytes, PROT_READ | PROT_WRITE)) {
+            m = NULL;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+    if (!m) {
+        puts("FATAL: The heap reservation is exhausted.");
+        exit(1);
+    }
+    return m;
+}
+
+void heap_give_back(char* m) {
+    // Dropped pages read as zero again
+    madvise(m, ARENA_BYTES, MADV_DONTNEED);
+    pthread_mutex_lock(&heap_lock);
+    if (heap_free_size == heap_free_capacity) {
+        heap_free_capacity = heap_free_capacity ? 2 * heap_free_capacity : 64;
+        heap_free = realloc(heap_free, heap_free_capacity * sizeof(*heap_free));
+    }
+    heap_free[heap_free_size++] = m;
+    pthread_mutex_unlock(&heap_lock);
+}
+#endif
+
+// Arenas are mapped directly, so that empty ones can be given back to
+// the OS.
+arena* arena_init(size_t shift, int leaf, int pairs) {
+#ifdef CON_COMPRESSED_REFS
+    char* start = heap_carve(ARENA_BYTES);
+#else
+    char* start = map_aligned(ARENA_BYTES, ARENA_BYTES, PROT_READ | PROT_WRITE);
+    if (!start) {
+        puts("FATAL: Could not map an arena.");
+        exit(1);
+    }
+#endif
+    // Fresh mappings are zero filled
+    arena* a = (arena*)start;
+    a->shift = shift;
+    a->leaf = leaf;
+    a->pairs = pairs;
+    a->capacity = 64 * (ARENA_WORDS >> (shift - PAIR_SHIFT));
     return a;
 }
 
 void arena_destroy(arena* a) {
-    free(a->contents);
-    free(a->free);
-    free(a);
+#ifdef CON_COMPRESSED_REFS
+    heap_give_back((char*)a);
+#else
+    munmap(a, ARENA_BYTES);
+#endif
+}
+
+arena* arena_of(con_term_t* t);
+
+inline arena* arena_of(con_term_t* t) {
+    return (arena*)((uintptr_t)t & ~(uintptr_t)(ARENA_BYTES - 1));
+}
+
+// The slot of a term in its arena. The tag of a pair is shifted out.
+size_t arena_index(arena* a, con_term_t* t);
+
+inline size_t arena_index(arena* a, con_term_t* t) {
+    return ((uintptr_t)t - (uintptr_t)a->contents) >> a->shift;
+}
+
+// The term in a slot, tagged if it is a pair
+con_term_t* arena_term(arena* a, size_t i) {
+    char* slot = a->contents + (i << a->shift);
+    return a->pairs ? CON_PAIR_TERM(slot) : (con_term_t*)slot;
+}
+
+void* arena_alloc(arena* a) {
+    if (a->size == a->capacity) {
+        puts("FATAL: Arena out of memory.");
+        abort();
+    }
+    while (a->alloc[a->cursor] == ~0ULL) {
+        a->cursor++;
+    }
+    uint64_t free = ~a->alloc[a->cursor];
+    uint64_t bit = free & -free;
+    a->alloc[a->cursor] |= bit;
+    a->size++;
+    return a->contents + ((64 * a->cursor + __builtin_ctzll(free)) << a->shift);
+}
+
+// Sets the mark bit of a term, returning whether it was set already
+int arena_mark(con_term_t* t) {
+    arena* a = arena_of(t);
+    size_t i = arena_index(a, t);
+    uint64_t bit = 1ULL << (i % 64);
+    if (a->marks[i / 64] & bit) {
+        return 1;
+    }
+    a->marks[i / 64] |= bit;
+    return 0;
+}
+
+int arena_is_marked(con_term_t* t) {
+    arena* a = arena_of(t);
+    size_t i = arena_index(a, t);
+    return (a->marks[i / 64] >> (i % 64)) & 1;
+}
+
+void arena_set_finalize(con_term_t* t) {
+    arena* a = arena_of(t);
+    size_t i = arena_index(a, t);
+    a->finalize[i / 64] |= 1ULL << (i % 64);
+}
+
+// Sets the remembered bit of a term, returning whether it was set already.
+// The background sweeper clears the bits of dead terms in the same words,
+// so every update of the remembered bitmap is atomic.
+int arena_remember(con_term_t* t) {
+    arena* a = arena_of(t);
+    size_t i = arena_index(a, t);
+    uint64_t bit = 1ULL << (i % 64);
+    if (__atomic_load_n(&a->remembered[i / 64], __ATOMIC_RELAXED) & bit) {
+        return 1;
+    }
+    return (__atomic_fetch_or(&a->remembered[i / 64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+void arena_forget(con_term_t* t) {
+    arena* a = arena_of(t);
+    size_t i = arena_index(a, t);
+    __atomic_fetch_and(&a->remembered[i / 64], ~(1ULL << (i % 64)), __ATOMIC_RELAXED);
 }
 
-con_term_t* arena_alloc(arena* a) {
-    if (a->capacity == a->size) {
-        printf("FATAL: Arena out of memory");
+// Finalization. Types owning resources outside the heap register a
+// finalizer, and their terms are copied onto the finalize queue when a
+// collection finds them dead, since their slot may be reused right
+// away. The queue is drained a batch at a time by con_gc, outside of
+// the pause. It is filled by the background sweeper as well.
+static con_finalizer finalizers[CON_NUM_TYPES] = {0};
+
+typedef struct {
+    con_term_t* items;
+    size_t capacity;
+    size_t size;
+    pthread_mutex_t lock;
+} finalize_queue;
+
+static finalize_queue finalizing = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+int needs_finalize(int type) {
+    return finalizers[type] != NULL;
+}
+
+size_t term_size(con_term_t*);
+
+void finalize_enqueue(con_term_t* t) {
+    pthread_mutex_lock(&finalizing.lock);
+    if (finalizing.size == finalizing.capacity) {
+        finalizing.capacity = finalizing.capacity ? 2 * finalizing.capacity : 64;
+        finalizing.items = realloc(finalizing.items,
+            finalizing.capacity * sizeof(*finalizing.items));
+    }
+    // Small terms are only copied as far as their slot goes
+    memcpy(&finalizing.items[finalizing.size], t, term_size(t));
+    // Read by finalize_pending without the lock
+    __atomic_store_n(&finalizing.size, finalizing.size + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&finalizing.lock);
+}
+
+size_t finalize_pending() {
+    return __atomic_load_n(&finalizing.size, __ATOMIC_RELAXED);
+}
+
+// Runs at most limit of the queued finalizers, returning how many ran
+size_t run_finalizers(size_t limit) {
+    con_term_t batch[FINALIZE_BATCH];
+    size_t done = 0;
+
+    while (done < limit) {
+        size_t n = limit - done < FINALIZE_BATCH ? limit - done : FINALIZE_BATCH;
+        pthread_mutex_lock(&finalizing.lock);
+        if (n > finalizing.size) {
+            n = finalizing.size;
+        }
+        if (!n) {
+            pthread_mutex_unlock(&finalizing.lock);
+            break;
+        }
+        __atomic_store_n(&finalizing.size, finalizing.size - n, __ATOMIC_RELAXED);
+        memcpy(batch, finalizing.items + finalizing.size, n * sizeof(*batch));
+        pthread_mutex_unlock(&finalizing.lock);
+        for (size_t i = 0; i < n; i++) {
+            finalizers[batch[i].type](&batch[i]);
+        }
+        done += n;
     }
-    // Pop the item off the free pool
-    size_t idx = a->free[a->size++];
-    return a->contents + idx;
+    stats.finalized += done;
+    return done;
+}
+
+void con_gc_set_finalizer(int type, con_finalizer finalizer) {
+    finalizers[type] = finalizer;
+}
+
+void con_gc_run_finalizers() {
+    run_finalizers(SIZE_MAX);
+}
+
+void ephemeron_table_finalize(con_term_t* t) {
+    g_hash_table_destroy(t->value.ephemerons);
 }
 
 void arena_sweep(arena* a) {
     if (a->size == 0) {
         return;
     }
-    con_term_t* t;
 #ifdef GC_DEBUG
     puts("Sweeping an arena");
 #endif
-    for (int i = 0; i < a->size; i++) {
-        t = a->contents + i;
-        if (!t->mark && t->type != UNDEFINED) {
-            // push this index onto the stack
+    size_t live = 0;
+    for (int w = 0; w < a->capacity / 64; w++) {
+        // Everything marked was allocated, so the marks are exactly
+        // what survives. Only dead terms with a finalizer are touched.
+        uint64_t dead = a->finalize[w] & ~a->marks[w];
+        while (dead) {
+            finalize_enqueue(arena_term(a, 64 * w + __builtin_ctzll(dead)));
+            dead &= dead - 1;
+        }
 #ifdef GC_DEBUG
+        dead = a->alloc[w] & ~a->marks[w];
+        while (dead) {
+            con_term_t* t = arena_term(a, 64 * w + __builtin_ctzll(dead));
             printf("Sweep: %p\n", (void*) t);
-#endif
-            if (t->type == ENVIRONMENT) {
-                con_env_deinit(t);
+            if (CON_IS_PAIR(t)) {
+                SET_CAR(t, CON_CONST(UNDEFINED));
+                SET_CDR(t, CON_CONST(UNDEFINED));
+            } else {
+                t->type = UNDEFINED;
             }
-            t->type = UNDEFINED;
-            a->free[--a->size] = i;
+            dead &= dead - 1;
         }
+#endif
+        a->alloc[w] = a->marks[w];
+        a->finalize[w] &= a->marks[w];
+        __atomic_fetch_and(&a->remembered[w], a->marks[w], __ATOMIC_RELAXED);
+        live += __builtin_popcountll(a->alloc[w]);
     }
-    // TODO: See if we can make this more specific
-    // Since we shouldn't have to reset **everything**
-    for (int i = 0; i < a->capacity; i++) {
-        a->contents[i].mark = 0;
-    }
+    memset(a->marks, 0, sizeof(a->marks));
+    a->size = live;
+    a->cursor = 0;
 #ifdef GC_DEBUG
     puts("Finished with an arena");
 #endif
@@ -96,253 +461,2321 @@ void arena_sweep(arena* a) {
 int arena_is_full(arena* a);
 
 inline int arena_is_full(arena* a) {
-    return a->capacity == a->size;
+    return a->size == a->capacity;
 }
 
+// The pool may be swept by a background thread, which hands arenas back
+// through the free list as it finishes them. The mutator only takes
+// the lock when the arena it allocates from has filled up.
 typedef struct {
     arena** arenas;
     size_t capacity;
     size_t size;
+    // The log2 of the size of the slots of its arenas
+    size_t shift;
+    // Whether its arenas hold terms which refer to no others
+    int leaf;
+    // Whether its arenas hold pairs
+    int pairs;
+    // The arena allocated from, which is off the free list
+    arena* current;
+    // Other arenas with free slots
+    arena* free;
+    // arenas[sweep_next..sweep_end) were marked but not swept yet
+    size_t sweep_next;
+    size_t sweep_end;
+    // Arenas which are being swept right now
+    size_t sweeping;
+    // Guards everything above but current
+    pthread_mutex_t lock;
+    // Signalled when there are arenas to sweep, and as they get swept
+    pthread_cond_t unswept;
+    pthread_cond_t swept;
+    pthread_t sweeper;
+    int sweeper_running;
+    int sweeper_exit;
 } arena_pool;
 
-arena_pool* arena_pool_init(size_t capacity) {
+arena_pool* arena_pool_init(size_t capacity, size_t shift, int leaf, int pairs) {
     arena_pool* p = calloc(1, sizeof(*p));
     arena **as = calloc(capacity, sizeof(*as));
     p->arenas = as;
     p->capacity = capacity;
     p->size = 0;
+    p->shift = shift;
+    p->leaf = leaf;
+    p->pairs = pairs;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->unswept, NULL);
+    pthread_cond_init(&p->swept, NULL);
     return p;
 }
 
+void arena_pool_stop_sweeper(arena_pool* p);
+
 void arena_pool_destroy(arena_pool* p) {
+    arena_pool_stop_sweeper(p);
     for (int i = 0; i < p->size; i++){
         arena_destroy(p->arenas[i]);
     }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->unswept);
+    pthread_cond_destroy(&p->swept);
     free(p->arenas);
     free(p);
 }
 
-con_term_t* arena_pool_alloc(arena_pool* p) {
-    for (int i = 0; i < p->size; i++) {
-        if (!arena_is_full(p->arenas[i])) {
-            return arena_alloc(p->arenas[i]);
+void arena_pool_push_free(arena_pool* p, arena* a) {
+    a->next_free = p->free;
+    p->free = a;
+}
+
+size_t arena_pool_unswept(arena_pool* p) {
+    return p->sweep_end - p->sweep_next;
+}
+
+// Sweeps the next arena left over from the last collection. Called with
+// the lock held, which is dropped while sweeping.
+void arena_pool_sweep_locked(arena_pool* p) {
+    arena* a = p->arenas[p->sweep_next++];
+    p->sweeping++;
+    pthread_mutex_unlock(&p->lock);
+    arena_sweep(a);
+    pthread_mutex_lock(&p->lock);
+    a->needs_sweep = 0;
+    p->sweeping--;
+    if (!arena_is_full(a)) {
+        arena_pool_push_free(p, a);
+    }
+    pthread_cond_broadcast(&p->swept);
+}
+
+// Sweeps one arena, returning 0 if there was none left
+int arena_pool_sweep_next(arena_pool* p) {
+    pthread_mutex_lock(&p->lock);
+    int found = arena_pool_unswept(p) > 0;
+    if (found) {
+        arena_pool_sweep_locked(p);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return found;
+}
+
+// Takes an arena with free slots off the free list. If there is none,
+// the mutator sweeps arenas itself rather than wait for the background
+// sweeper, and only grows the pool once there is nothing left to sweep.
+// Returns NULL if it would have to grow beyond max arenas.
+arena* arena_pool_next_free(arena_pool* p, size_t max) {
+    pthread_mutex_lock(&p->lock);
+    // Nothing is allocated into an arena before it has been swept, so
+    // unswept arenas are only reached by sweeping them here
+    while (!p->free && arena_pool_unswept(p)) {
+        arena_pool_sweep_locked(p);
+    }
+    if (!p->free) {
+        if (p->size >= max) {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
         }
+        if (p->size == p->capacity) {
+            p->capacity *= 2;
+            p->arenas = realloc(p->arenas, p->capacity * sizeof(*p->arenas));
+        }
+        arena* a = arena_init(p->shift, p->leaf, p->pairs);
+        p->arenas[p->size++] = a;
+        arena_pool_push_free(p, a);
     }
-    if (p->size == p->capacity) {
-        realloc(p->arenas, ++(p->capacity) * sizeof(*p->arenas));
+    arena* a = p->free;
+    p->free = a->next_free;
+    pthread_mutex_unlock(&p->lock);
+    return a;
+}
+
+// Returns NULL if the pool would have to grow beyond max arenas
+void* arena_pool_alloc_within(arena_pool* p, size_t max) {
+    if (!p->current || arena_is_full(p->current)) {
+        arena* a = arena_pool_next_free(p, max);
+        if (!a) {
+            return NULL;
+        }
+        p->current = a;
     }
-    arena* a = arena_init(POOL_ARENA_SIZE);
-    p->arenas[p->size++] = a;
-    return arena_alloc(a);
+    return arena_alloc(p->current);
 }
 
-void arena_pool_sweep(arena_pool* p) {
-    size_t total = 0;
+void* arena_pool_alloc(arena_pool* p) {
+    return arena_pool_alloc_within(p, SIZE_MAX);
+}
+
+
+// Called once marking is done. Arenas created after this only hold
+// live terms and are never swept for this collection.
+// Returns the number of marked terms.
+size_t arena_pool_begin_sweep(arena_pool* p) {
+    size_t live = 0;
+    pthread_mutex_lock(&p->lock);
     for (int i = 0; i < p->size; i++) {
-        arena_sweep(p->arenas[i]);
-        total += p->arenas[i]->size;
+        arena* a = p->arenas[i];
+        a->needs_sweep = 1;
+        for (int w = 0; w < a->capacity / 64; w++) {
+            live += __builtin_popcountll(a->marks[w]);
+        }
     }
+    // Sweeping puts arenas back on the free list as it finds room in them
+    p->current = NULL;
+    p->free = NULL;
+    p->sweep_next = 0;
+    p->sweep_end = p->size;
+    pthread_cond_signal(&p->unswept);
+    pthread_mutex_unlock(&p->lock);
+    return live;
 }
 
-static arena_pool *obj_pool = NULL;
-
-void symbol_destroy(void* t) {
-    con_term_t *sym = t;
-    free(sym->value.sym.str);
-    free(sym);
+// Sweeps every arena which is still left over from the last collection,
+// and waits for the ones the background sweeper is busy with.
+void arena_pool_sweep(arena_pool* p) {
+    pthread_mutex_lock(&p->lock);
+#ifdef GC_DEBUG
+    if (arena_pool_unswept(p)) {
+        printf("Sweeping %lu arenas left by the last GC.\n", arena_pool_unswept(p));
+    }
+#endif
+    while (arena_pool_unswept(p)) {
+        arena_pool_sweep_locked(p);
+    }
+    while (p->sweeping) {
+        pthread_cond_wait(&p->swept, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
 }
 
-void con_alloc_init() {
-    obj_pool    = arena_pool_init(POOL_SIZE);
-    con_symbols = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, symbol_destroy);
-    con_true    = malloc(sizeof(*con_true));
-    con_true->type = CON_TRUE;
-    con_false   = malloc(sizeof(*con_false));
-    con_false->type = CON_FALSE;
+void* arena_pool_sweeper_main(void* arg) {
+    arena_pool* p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->sweeper_exit) {
+        if (arena_pool_unswept(p)) {
+            arena_pool_sweep_locked(p);
+        } else {
+            pthread_cond_wait(&p->unswept, &p->lock);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
 }
 
-void destroy_roots();
+// Unmaps all but retain of the empty arenas, once every arena has been
+// swept. Returns the number of arenas released.
+size_t arena_pool_release(arena_pool* p, size_t retain) {
+    size_t kept = 0, released = 0;
 
-void con_alloc_deinit() {
-    // Free singleton objects
-    free(con_true);
-    free(con_false);
-    destroy_roots();
-    arena_pool_destroy(obj_pool);
-    g_hash_table_destroy(con_symbols);
+    pthread_mutex_lock(&p->lock);
+    if (arena_pool_unswept(p) || p->sweeping) {
+        pthread_mutex_unlock(&p->lock);
+        return 0;
+    }
+    for (size_t i = 0; i < p->size; i++) {
+        arena* a = p->arenas[i];
+        if (a->size == 0 && a != p->current && kept++ >= retain) {
+            arena_destroy(a);
+            released++;
+        } else {
+            p->arenas[i - released] = a;
+        }
+    }
+    p->size -= released;
+    if (released) {
+        // Released arenas may have been anywhere on the free list
+        p->free = NULL;
+        for (size_t i = p->size; i-- > 0;) {
+            arena* a = p->arenas[i];
+            if (a != p->current && !arena_is_full(a)) {
+                arena_pool_push_free(p, a);
+            }
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return released;
 }
 
-void con_gc();
+// Starts the pool over without any arenas, returning the old ones
+arena** arena_pool_detach(arena_pool* p, size_t* size) {
+    pthread_mutex_lock(&p->lock);
+    arena** old = p->arenas;
+    *size = p->size;
+    p->arenas = calloc(p->capacity, sizeof(*p->arenas));
+    p->size = 0;
+    p->current = NULL;
+    p->free = NULL;
+    p->sweep_next = 0;
+    p->sweep_end = 0;
+    pthread_mutex_unlock(&p->lock);
+    return old;
+}
 
-con_term_t* con_alloc(int type) {
-    con_term_t* term = arena_pool_alloc(obj_pool);
-    term->type = type;
-    if (type == EMPTY_LIST) {
-        CAR(term) = NULL;
-        CDR(term) = NULL;
-        term->value.list.length = 0;
+void arena_pool_start_sweeper(arena_pool* p) {
+    if (!p->sweeper_running) {
+        p->sweeper_running = 1;
+        pthread_create(&p->sweeper, NULL, arena_pool_sweeper_main, p);
     }
-    allocations_since_gc += 1;
-    return term;
 }
 
-con_term_t* con_alloc_sym(char* sym) {
-    con_term_t* s;
-    if (!(s = g_hash_table_lookup(con_symbols, sym))){
-        size_t l = strlen(sym);
-        // Create the symbol
-        s = malloc(sizeof(*s));
-        s->type = SYMBOL;
-        s->value.sym.str = malloc((l + 1) * sizeof(char));
-        strcpy(s->value.sym.str, sym);
-        s->value.sym.size = l;
-        g_hash_table_insert(con_symbols, sym, s);
+void arena_pool_stop_sweeper(arena_pool* p) {
+    if (!p->sweeper_running) {
+        return;
     }
-    return s;
+    pthread_mutex_lock(&p->lock);
+    p->sweeper_exit = 1;
+    pthread_cond_signal(&p->unswept);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->sweeper, NULL);
+    p->sweeper_running = 0;
+    p->sweeper_exit = 0;
 }
 
-con_term_t* con_alloc_pair(con_term_t* fst, con_term_t* snd) {
-    con_term_t *term, *term_cdr;
-    term = con_alloc(LIST);
-    term->value.list.length = 2;
-    term_cdr = con_alloc(LIST);
-    term_cdr->value.list.length = 1;
+// Terms are segregated into pools by size. Those which refer to no
+// other terms have a pool of their own, whose terms marking never has to
+// look at. Pairs are not typed, so they are not in type_pool.
+enum {
+    TERM_POOL,
+    SMALL_POOL,
+    LEAF_POOL,
+    PAIR_POOL,
+    NUM_POOLS
+};
 
-    CAR(term_cdr) = snd;
-    CDR(term_cdr) = con_alloc(EMPTY_LIST);
-    CAR(term) = fst;
-    CDR(term) = term_cdr;
+static arena_pool* pools[NUM_POOLS] = {NULL};
 
-    return term;
+static const int type_pool[CON_NUM_TYPES] = {
+    [FLONUM]          = LEAF_POOL,
+    [BUILTIN]         = LEAF_POOL,
+    [WEAK_BOX]        = SMALL_POOL,
+    [EPHEMERON_TABLE] = SMALL_POOL,
+};
+
+static const size_t pool_shift[NUM_POOLS] = {TERM_SHIFT, SMALL_SHIFT, SMALL_SHIFT, PAIR_SHIFT};
+
+size_t type_size(int type) {
+    return (size_t)1 << pool_shift[type_pool[type]];
 }
 
-con_term_t* con_alloc_env(con_term_t* parent) {
-    con_term_t* t = con_alloc(ENVIRONMENT);
-    con_env_init(t, parent);
+// The young generation. Terms and pairs are bump allocated here and
+// survivors are evacuated into the pools by a minor collection, after
+// which the whole nursery is free again.
+typedef struct {
+    char* start;
+    char* top;
+    char* end;
+} nursery;
+
+nursery* nursery_init(size_t bytes) {
+    nursery* n = calloc(1, sizeof(*n));
+#ifdef CON_COMPRESSED_REFS
+    n->start = heap_carve(bytes);
+#else
+    n->start = calloc(bytes, 1);
+#endif
+    n->top = n->start;
+    n->end = n->start + bytes;
+    return n;
+}
+
+void nursery_destroy(nursery* n) {
+#ifndef CON_COMPRESSED_REFS
+    // Otherwise it goes with the heap reservation
+    free(n->start);
+#endif
+    free(n);
+}
+
+void* nursery_alloc(nursery* n, size_t bytes) {
+    if ((size_t)(n->end - n->top) < bytes) {
+        return NULL;
+    }
+    void* t = n->top;
+    n->top += bytes;
     return t;
 }
 
-con_term_t* con_alloc_true() {
-    return con_true;
+int nursery_contains(nursery* n, con_term_t* t);
+
+// A fixnum may well look like an address in the nursery
+inline int nursery_contains(nursery* n, con_term_t* t) {
+    return !CON_IS_IMMEDIATE(t) && (char*)t >= n->start && (char*)t < n->top;
 }
 
-con_term_t* con_alloc_false() {
-    return con_false;
+// In bytes
+size_t nursery_size(nursery* n) {
+    return n->top - n->start;
 }
 
-typedef struct root {
-    con_term_t** t;
-    struct root* next;
-} root;
+static nursery *young = NULL;
 
-static root* roots = NULL;
+// A growable stack of terms used for the collector's bookkeeping.
+typedef struct {
+    con_term_t** items;
+    size_t capacity;
+    size_t size;
+} term_stack;
 
-size_t count_roots() {
-    size_t count = 0;
-    for (root *r = roots; r != NULL; r = r->next) {
-        count++;
+void term_stack_push(term_stack* s, con_term_t* t) {
+    if (s->size == s->capacity) {
+        s->capacity = s->capacity ? 2 * s->capacity : 64;
+        s->items = realloc(s->items, s->capacity * sizeof(*s->items));
     }
-    return count;
+    s->items[s->size++] = t;
 }
 
-void con_gc() {
-    if ((!initial_gc && allocations_since_gc < INIT_GC_ALLOC_TRIGGER) ||
-        (allocations_since_gc < GC_ALLOC_TRIGGER)) {
-        return;
+con_term_t* term_stack_pop(term_stack* s) {
+    return s->items[--s->size];
+}
+
+void term_stack_destroy(term_stack* s) {
+    free(s->items);
+    s->items = NULL;
+    s->capacity = s->size = 0;
+}
+
+// Old terms which may point into the nursery
+static term_stack remembered = {0};
+// Promoted terms whose fields have not been evacuated yet
+static term_stack promoted = {0};
+// Terms allocated in the nursery with a finalizer, which is queued if
+// they die young.
+static term_stack young_finalize = {0};
+// Every weak box and ephemeron table, whose references are cleared by
+// weak_process once a major collection has found what is reachable.
+static term_stack weak_terms = {0};
+// Tri-color marking: a term is white until it is marked, grey while it
+// is marked and on the grey stack and black once its slots are shaded.
+static term_stack grey = {0};
+// Terms copied by a compaction, in the order they were copied, whose
+// slots still point at the old arenas
+static term_stack copied = {0};
+
+// Memory outside the arenas which belongs to terms: symbol names, the
+// intern table and the tables of environments. It counts against the
+// heap limit like the arenas do. Ephemeron tables are not counted.
+static size_t external_bytes = 0;
+
+// Symbols are allocated in the old generation like any other term, and
+// collected once nothing refers to them. Their names are bump allocated
+// from string chunks, which are freed once every symbol in them has
+// died, and copied into fresh ones by a compaction.
+#define STRING_CHUNK_BYTES (16 * 1024)
+#define INTERN_MIN_CAPACITY 256
+
+typedef struct string_chunk {
+    struct string_chunk* next;
+    size_t capacity;
+    size_t used;
+    // Bytes of names whose symbol is still alive
+    size_t live;
+    char data[];
+} string_chunk;
+
+// The first chunk is the one being bumped
+static string_chunk* string_chunks = NULL;
+
+string_chunk* string_chunk_init(size_t capacity) {
+    string_chunk* c = malloc(sizeof(*c) + capacity);
+    external_bytes += sizeof(*c) + capacity;
+    c->next = NULL;
+    c->capacity = capacity;
+    c->used = 0;
+    c->live = 0;
+    return c;
+}
+
+// Copies a name into the chunks. Long names get a chunk of their own,
+// which goes behind the one being bumped.
+char* string_alloc(const char* name, size_t size, string_chunk** chunk) {
+    size_t bytes = size + 1;
+    string_chunk* c = string_chunks;
+
+    if (bytes > STRING_CHUNK_BYTES / 4) {
+        c = string_chunk_init(bytes);
+        if (string_chunks) {
+            c->next = string_chunks->next;
+            string_chunks->next = c;
+        } else {
+            string_chunks = c;
+        }
+    } else if (!c || c->capacity - c->used < bytes) {
+        c = string_chunk_init(STRING_CHUNK_BYTES);
+        c->next = string_chunks;
+        string_chunks = c;
     }
-    allocations_since_gc = 0;
-    initial_gc = 1;
-    root* r = roots;
-#ifdef GC_DEBUG
-    puts("\nGC Running.");
-    printf("There are %lu roots.\n", count_roots());
-    puts("Marky mark");
-#endif
-    while (r != NULL) {
-        if (*r->t) {
-            trace(*r->t);
+    char* str = c->data + c->used;
+    memcpy(str, name, size);
+    str[size] = '\0';
+    c->used += bytes;
+    c->live += bytes;
+    *chunk = c;
+    return str;
+}
+
+void string_release(con_term_t* sym) {
+    sym->value.sym.chunk->live -= sym->value.sym.size + 1;
+}
+
+// Frees the chunks without any live names, but the one being bumped
+void string_chunks_free_empty() {
+    string_chunk** c = &string_chunks;
+    while (*c) {
+        if (!(*c)->live && *c != string_chunks) {
+            string_chunk* dead = *c;
+            *c = dead->next;
+            external_bytes -= sizeof(*dead) + dead->capacity;
+            free(dead);
+        } else {
+            c = &(*c)->next;
         }
-        r = r->next;
     }
-#ifdef GC_DEBUG
-    puts("Sweepy sweep.");
-#endif
-    arena_pool_sweep(obj_pool);
-#ifdef GC_DEBUG
-    puts("GC run complete.");
-#endif
 }
 
-void trace(con_term_t*);
+void string_chunks_destroy(string_chunk* c) {
+    while (c) {
+        string_chunk* next = c->next;
+        external_bytes -= sizeof(*c) + c->capacity;
+        free(c);
+        c = next;
+    }
+}
 
-void mark_environment_values(GHashTable* g) {
-    GHashTableIter iter;
-    gpointer key, value;
+// The intern table holds symbols weakly, by the hash stored in them with
+// linear probing. Dead symbols are left as tombstones until it is next
+// resized.
+typedef struct {
+    con_term_t** slots;
+    size_t capacity;
+    size_t size;
+    size_t tombstones;
+} intern_table;
 
-    g_hash_table_iter_init(&iter, g);
-    while (g_hash_table_iter_next(&iter, &key, &value))
-    {
-        con_term_t* t = value;
-        trace(t);
+static intern_table interned = {0};
+static con_term_t intern_tombstone;
+
+#define TOMBSTONE (&intern_tombstone)
+
+// FNV-1a
+unsigned int string_hash(const char* s, size_t size) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
     }
+    return h;
 }
 
-void trace(con_term_t* t) {
-    if (!t || t->mark) {
-        return;
+int is_interned(con_term_t* t) {
+    return t && t != TOMBSTONE;
+}
+
+// Returns the slot holding the symbol with the given name, or else the
+// slot it should be added in
+con_term_t** intern_find(const char* name, size_t size, unsigned int hash) {
+    size_t mask = interned.capacity - 1;
+    con_term_t** free_slot = NULL;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        con_term_t** slot = &interned.slots[i];
+        con_term_t* t = *slot;
+        if (!t) {
+            return free_slot ? free_slot : slot;
+        }
+        if (t == TOMBSTONE) {
+            if (!free_slot) {
+                free_slot = slot;
+            }
+        } else if (t->value.sym.hash == hash && t->value.sym.size == size &&
+            !memcmp(t->value.sym.str, name, size)) {
+            return slot;
+        }
     }
-#ifdef GC_DEBUG
-    /* printf("Tracing: %p\n", (void*)t); */
-#endif
-    t->mark = 1;
-    if (t->type == LIST) {
-        trace(t->value.list.car);
-        trace(t->value.list.cdr);
-    } else if (t->type == LAMBDA) {
-        trace(t->value.lambda.vars);
-        trace(t->value.lambda.body);
-        trace(t->value.lambda.parent_env);
-    } else if (t->type == ENVIRONMENT) {
-        mark_environment_values(t->value.env.table);
+}
+
+void intern_resize(size_t capacity) {
+    con_term_t** old = interned.slots;
+    size_t old_capacity = interned.capacity;
+
+    interned.slots = calloc(capacity, sizeof(*interned.slots));
+    external_bytes += (capacity - old_capacity) * sizeof(*interned.slots);
+    interned.capacity = capacity;
+    interned.tombstones = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        con_term_t* t = old[i];
+        if (!is_interned(t)) {
+            continue;
+        }
+        size_t j = t->value.sym.hash & (capacity - 1);
+        while (interned.slots[j]) {
+            j = (j + 1) & (capacity - 1);
+        }
+        interned.slots[j] = t;
     }
+    free(old);
 }
 
-void con_root(con_term_t **t) {
-#ifdef GC_DEBUG
-    printf("Rooting object:   %p\n", (void*)(t));
-#endif
-    root* r = malloc(sizeof(*r));
-    r->t = t;
-    r->next = roots;
-    roots = r;
+void symbols_destroy() {
+    external_bytes -= interned.capacity * sizeof(*interned.slots);
+    free(interned.slots);
+    interned = (intern_table){0};
+    string_chunks_destroy(string_chunks);
+    string_chunks = NULL;
 }
 
-void con_unroot(con_term_t **t) {
-#ifdef GC_DEBUG
-    if (*t) {
-        printf("Unrooting object: %p\n", (void*)(t));
-    } else {
-        puts("Unrooting a currently NULL object.");
+void con_alloc_init() {
+    char* env;
+    if ((env = getenv("CON_GC_MIN_TRIGGER"))) {
+        con_gc_set_min_trigger(strtoul(env, NULL, 10));
     }
+    if ((env = getenv("CON_GC_GROWTH_FACTOR"))) {
+        con_gc_set_growth_factor(strtod(env, NULL));
+    }
+    if ((env = getenv("CON_GC_RETAIN_BYTES"))) {
+        con_gc_set_retain_bytes(strtoul(env, NULL, 10));
+    }
+    if ((env = getenv("CON_HEAP_PROFILE"))) {
+        con_heap_profile(strtoul(env, NULL, 10));
+    }
+    if ((env = getenv("CON_HEAP_LIMIT"))) {
+        con_gc_set_heap_limit(strtoul(env, NULL, 10));
+    }
+    if ((env = getenv("CON_EVAL_BUDGET"))) {
+        con_gc_set_eval_budget(strtoul(env, NULL, 10));
+    }
+    if ((env = getenv("CON_GC_CONSERVATIVE"))) {
+        con_gc_set_conservative(strtol(env, NULL, 10));
+    }
+    con_gc_set_finalizer(ENVIRONMENT, con_env_deinit);
+    con_gc_set_finalizer(EPHEMERON_TABLE, ephemeron_table_finalize);
+    gc_trigger  = gc_min_trigger;
+#ifdef CON_COMPRESSED_REFS
+    heap_reserve();
 #endif
-    root **r;
-    for (r = &roots; *r != NULL; r = &(*r)->next) {
-        if ((*r)->t == t) {
-            root* next = (*r)->next;
-            free(*r);
-            *r = next;
-            return;
+    for (int i = 0; i < NUM_POOLS; i++) {
+        pools[i] = arena_pool_init(POOL_SIZE, pool_shift[i], i == LEAF_POOL,
+            i == PAIR_POOL);
+        if (background_sweep) {
+            arena_pool_start_sweeper(pools[i]);
         }
     }
-    puts("UNREACHABLE!");
-    *NULL;
+    young       = nursery_init(NURSERY_BYTES);
+    intern_resize(INTERN_MIN_CAPACITY);
 }
 
-void destroy_roots() {
-    root *r = roots, *p = NULL;
-    while (r) {
-        p = r;
-        r = r->next;
-        free(p);
+void destroy_roots();
+void profile_destroy();
+void symbols_destroy();
+
+void con_alloc_deinit() {
+    destroy_roots();
+    for (size_t i = 0; i < young_finalize.size; i++) {
+        finalize_enqueue(young_finalize.items[i]);
     }
+    term_stack_destroy(&young_finalize);
+    term_stack_destroy(&weak_terms);
+    term_stack_destroy(&remembered);
+    term_stack_destroy(&promoted);
+    term_stack_destroy(&grey);
+    term_stack_destroy(&copied);
+    con_gc_set_mark_threads(1);
+    nursery_destroy(young);
+    for (int i = 0; i < NUM_POOLS; i++) {
+        arena_pool_destroy(pools[i]);
+        pools[i] = NULL;
+    }
+    // After the sweeper has stopped
+    con_gc_run_finalizers();
+    free(finalizing.items);
+    finalizing.items = NULL;
+    finalizing.capacity = 0;
+    symbols_destroy();
+    profile_destroy();
+#ifdef CON_COMPRESSED_REFS
+    heap_unreserve();
+#endif
+}
+
+void con_gc();
+
+void shade(con_term_t*);
+
+// Heap profiling. Every profile_rate-th allocation is tagged with the
+// operator of the form being evaluated, so that con_heap_dump can tell
+// where the live heap was allocated. Sites are numbered by name.
+con_term_t* con_alloc_site = NULL;
+static size_t profile_rate = 0;
+static size_t profile_countdown = 0;
+static GHashTable* profile_site_ids = NULL;
+// Site names by number, 0 being unsampled terms
+static char** profile_sites = NULL;
+// Pairs have no room for a site, so sampled ones are kept here instead,
+// with their site as a fixnum. The collector holds them weakly.
+static GHashTable* profile_pairs = NULL;
+static size_t profile_sites_size = 0;
+static size_t profile_sites_capacity = 0;
+
+#define PROFILE_MAX_SITES (1 << 24)
+
+unsigned int profile_site(con_term_t* site) {
+    char* name = site ? site->value.sym.str : "<other>";
+    unsigned int id = GPOINTER_TO_UINT(g_hash_table_lookup(profile_site_ids, name));
+    if (id || profile_sites_size == PROFILE_MAX_SITES) {
+        return id;
+    }
+    if (profile_sites_size == profile_sites_capacity) {
+        profile_sites_capacity *= 2;
+        profile_sites = realloc(profile_sites, profile_sites_capacity * sizeof(*profile_sites));
+    }
+    id = profile_sites_size++;
+    profile_sites[id] = strdup(name);
+    g_hash_table_insert(profile_site_ids, profile_sites[id], GUINT_TO_POINTER(id));
+    return id;
+}
+
+void con_heap_profile(size_t rate) {
+    if (rate && !profile_site_ids) {
+        profile_site_ids = g_hash_table_new(g_str_hash, g_str_equal);
+        profile_pairs = g_hash_table_new(g_direct_hash, g_direct_equal);
+        profile_sites_capacity = 64;
+        profile_sites = calloc(profile_sites_capacity, sizeof(*profile_sites));
+        profile_sites_size = 1;
+    }
+    profile_rate = rate;
+    profile_countdown = rate;
+}
+
+void profile_destroy() {
+    if (!profile_site_ids) {
+        return;
+    }
+    g_hash_table_destroy(profile_site_ids);
+    g_hash_table_destroy(profile_pairs);
+    for (size_t i = 1; i < profile_sites_size; i++) {
+        free(profile_sites[i]);
+    }
+    free(profile_sites);
+    profile_site_ids = NULL;
+    profile_pairs = NULL;
+    profile_sites = NULL;
+    profile_rate = 0;
+}
+
+// Quotas. Top level evaluations can be run under a guard, which has
+// them abandoned once they have allocated more than eval_budget bytes,
+// or once the old generation and the external memory of its terms
+// outgrow heap_limit. The limit is checked at every safepoint, which
+// collects before giving up. Allocations in between cannot collect, so
+// they give up if they would have to grow the pool beyond the limit.
+// Collections themselves may go over it.
+static size_t heap_limit = 0;
+static size_t eval_budget = 0;
+static size_t eval_allocated = 0;
+// Where con_eval_begin was called, and the depth of the shadow stack
+// there, or NULL outside of a guarded evaluation
+static jmp_buf* eval_abort = NULL;
+static size_t eval_roots = 0;
+
+// What the old generation holds at most, from what survived the last
+// major gc and what has been allocated into it since, and what terms
+// hold outside of it
+size_t heap_used() {
+    return live_bytes + bytes_since_gc + external_bytes;
+}
+
+// The arenas which fit in the limit next to the external memory
+size_t heap_limit_arenas() {
+    if (!heap_limit) {
+        return SIZE_MAX;
+    }
+    return heap_limit > external_bytes ? (heap_limit - external_bytes) / ARENA_BYTES : 0;
+}
+
+// The sweepers change the arenas of their pools
+void pools_lock() {
+    for (int i = 0; i < NUM_POOLS; i++) {
+        pthread_mutex_lock(&pools[i]->lock);
+    }
+}
+
+void pools_unlock() {
+    for (int i = NUM_POOLS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&pools[i]->lock);
+    }
+}
+
+size_t arena_count() {
+    size_t n = 0;
+    for (int i = 0; i < NUM_POOLS; i++) {
+        n += pools[i]->size;
+    }
+    return n;
+}
+
+void con_gc_set_heap_limit(size_t bytes) {
+    heap_limit = bytes;
+}
+
+void con_gc_set_eval_budget(size_t bytes) {
+    eval_budget = bytes;
+}
+
+void con_eval_begin(jmp_buf* escape) {
+    eval_abort = escape;
+    eval_roots = con_roots_size;
+    eval_allocated = 0;
+}
+
+void con_eval_end() {
+    eval_abort = NULL;
+}
+
+// Abandons the guarded evaluation, or exits if there is none. Only
+// called before anything has been allocated, so the heap is consistent
+// and only has to forget about the roots of the frames being unwound.
+void quota_exceeded(char* quota) {
+    jmp_buf* escape = eval_abort;
+    if (!escape) {
+        printf("FATAL: Exceeded %s.\n", quota);
+        exit(1);
+    }
+    printf("ERROR: Evaluation abandoned, it exceeded %s.\n", quota);
+    stats.evals_abandoned++;
+    eval_abort = NULL;
+    con_roots_size = eval_roots;
+    con_alloc_site = NULL;
+    longjmp(*escape, 1);
+}
+
+void charge_eval(size_t bytes) {
+    eval_allocated += bytes;
+    if (eval_budget && eval_abort && eval_allocated > eval_budget) {
+        quota_exceeded("its allocation budget");
+    }
+}
+
+void con_gc_external_alloc(size_t bytes) {
+    external_bytes += bytes;
+    charge_eval(bytes);
+}
+
+void con_gc_external_free(size_t bytes) {
+    external_bytes -= bytes;
+}
+
+// Old generation allocations by the mutator, which may not grow the
+// heap beyond its limit during a guarded evaluation
+void* mutator_alloc_old(arena_pool* p) {
+    size_t max = SIZE_MAX;
+    if (eval_abort && heap_limit) {
+        size_t others = arena_count() - p->size;
+        max = heap_limit_arenas() > others ? heap_limit_arenas() - others : 0;
+    }
+    void* t = arena_pool_alloc_within(p, max);
+    if (!t) {
+        quota_exceeded("the heap limit");
+    }
+    allocations_since_gc += 1;
+    bytes_since_gc += 1 << p->shift;
+    return t;
+}
+
+void remember(con_term_t* t) {
+    if (!arena_remember(t)) {
+        term_stack_push(&remembered, t);
+    }
+}
+
+// The nursery is full until the next safepoint, so t went straight to
+// the old generation. Its fields are filled in after the barrier could
+// see them, so it is remembered unconditionally, and an incremental
+// mark scans it once they are.
+void allocated_old(con_term_t* t) {
+    if (!conservative) {
+        remember(t);
+    }
+    if (phase == GC_MARKING) {
+        shade(t);
+    }
+}
+
+con_term_t* con_alloc(int type) {
+    size_t size = type_size(type);
+    charge_eval(size);
+    con_term_t* term = conservative ? NULL : nursery_alloc(young, size);
+    if (term) {
+        if (needs_finalize(type)) {
+            term_stack_push(&young_finalize, term);
+        }
+    } else {
+        term = mutator_alloc_old(pools[type_pool[type]]);
+        term->type = type;
+        if (needs_finalize(type)) {
+            arena_set_finalize(term);
+        }
+        allocated_old(term);
+    }
+    allocations_since_step += 1;
+    stats.allocated[type]++;
+    stats.bytes_allocated[type] += size;
+    term->type = type;
+    term->site = 0;
+    if (profile_rate && --profile_countdown == 0) {
+        profile_countdown = profile_rate;
+        term->site = profile_site(con_alloc_site);
+    }
+    return term;
+}
+
+con_term_t* con_alloc_cons(con_term_t* car, con_term_t* cdr) {
+    charge_eval(sizeof(con_pair));
+    con_pair* p = conservative ? NULL : nursery_alloc(young, sizeof(con_pair));
+    con_term_t* pair;
+    if (p) {
+        pair = CON_PAIR_TERM(p);
+    } else {
+        pair = CON_PAIR_TERM(mutator_alloc_old(pools[PAIR_POOL]));
+        // Unlike allocated_old, its fields are known already, so it is
+        // only remembered if one of them is young
+        if (nursery_contains(young, car) || nursery_contains(young, cdr)) {
+            remember(pair);
+        }
+        if (phase == GC_MARKING) {
+            shade(pair);
+        }
+    }
+    allocations_since_step += 1;
+    stats.allocated[LIST]++;
+    stats.bytes_allocated[LIST] += sizeof(con_pair);
+    SET_CAR(pair, car);
+    SET_CDR(pair, cdr);
+    if (profile_rate && --profile_countdown == 0) {
+        profile_countdown = profile_rate;
+        g_hash_table_insert(profile_pairs, pair, CON_FIXNUM(profile_site(con_alloc_site)));
+    }
+    return pair;
+}
+
+con_term_t* con_alloc_sym(char* name) {
+    size_t size = strlen(name);
+    unsigned int hash = string_hash(name, size);
+
+    // Keep the table at most three quarters full, tombstones included
+    if ((interned.size + interned.tombstones + 1) * 4 > interned.capacity * 3) {
+        size_t capacity = INTERN_MIN_CAPACITY;
+        while ((interned.size + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+        if (capacity > interned.capacity) {
+            charge_eval((capacity - interned.capacity) * sizeof(*interned.slots));
+        }
+        intern_resize(capacity);
+    }
+    con_term_t** slot = intern_find(name, size, hash);
+    if (is_interned(*slot)) {
+        // A symbol the marker has not reached yet is reachable again
+        if (phase == GC_MARKING) {
+            shade(*slot);
+        }
+        return *slot;
+    }
+    charge_eval(sizeof(con_term_t) + size + 1);
+    // Symbols tend to live long, so they skip the nursery
+    con_term_t* s = mutator_alloc_old(pools[TERM_POOL]);
+    if (*slot == TOMBSTONE) {
+        interned.tombstones--;
+    }
+    s->type = SYMBOL;
+    s->site = 0;
+    s->value.sym.str = string_alloc(name, size, &s->value.sym.chunk);
+    s->value.sym.size = size;
+    s->value.sym.hash = hash;
+    *slot = s;
+    interned.size++;
+    stats.allocated[SYMBOL]++;
+    stats.bytes_allocated[SYMBOL] += sizeof(*s) + size + 1;
+    if (phase == GC_MARKING) {
+        shade(s);
+    }
+    return s;
+}
+
+con_term_t* con_alloc_pair(con_term_t* fst, con_term_t* snd) {
+    return con_alloc_cons(fst, con_alloc_cons(snd, con_alloc_empty_list()));
+}
+
+con_term_t* con_alloc_env(con_term_t* parent) {
+    con_term_t* t = con_alloc(ENVIRONMENT);
+    con_env_init(t, parent);
+    return t;
+}
+
+con_term_t* con_alloc_weak_box(con_term_t* value) {
+    con_term_t* t = con_alloc(WEAK_BOX);
+    t->value.weak = value;
+    term_stack_push(&weak_terms, t);
+    return t;
+}
+
+// Keys are compared by identity
+con_term_t* con_alloc_ephemeron_table() {
+    con_term_t* t = con_alloc(EPHEMERON_TABLE);
+    t->value.ephemerons = g_hash_table_new(g_direct_hash, g_direct_equal);
+    term_stack_push(&weak_terms, t);
+    return t;
+}
+
+con_term_t* con_ephemeron_ref(con_term_t* table, con_term_t* key) {
+    return g_hash_table_lookup(table->value.ephemerons, key);
+}
+
+void con_ephemeron_set(con_term_t* table, con_term_t* key, con_term_t* value) {
+    g_hash_table_insert(table->value.ephemerons, key, value);
+    con_write_barrier(table, key);
+    con_write_barrier(table, value);
+}
+
+con_term_t* con_alloc_flonum(double d) {
+#ifdef CON_NAN_BOXING
+    return con_box_flonum(d);
+#else
+    con_term_t* t = con_alloc(FLONUM);
+    t->value.flonum = d;
+    return t;
+#endif
+}
+
+con_term_t* con_alloc_fixnum(long n) {
+    return CON_FIXNUM_FITS(n) ? CON_FIXNUM(n) : con_alloc_flonum(n);
+}
+
+con_term_t* con_alloc_true() {
+    return CON_CONST(CON_TRUE);
+}
+
+con_term_t* con_alloc_false() {
+    return CON_CONST(CON_FALSE);
+}
+
+con_term_t* con_alloc_empty_list() {
+    return CON_CONST(EMPTY_LIST);
+}
+
+// The shadow stack of rooted slots, pushed and popped inline by
+// con_root and con_unroot
+con_term_t*** con_roots = NULL;
+size_t con_roots_size = 0;
+size_t con_roots_capacity = 0;
+
+size_t count_roots() {
+    return con_roots_size;
+}
+
+typedef void (*slot_visitor)(con_term_t**);
+
+// Calls visit on the keys and values of a table keyed by terms, which
+// environments and ephemeron tables are, first dropping the entries
+// whose key is not live if is_live is given. Entries whose key moved are
+// inserted again, as its address may be what they are hashed by.
+void visit_entries(GHashTable* g, int (*is_live)(con_term_t*), slot_visitor visit) {
+    GHashTableIter iter;
+    gpointer key, value;
+    term_stack moved = {0};
+
+    g_hash_table_iter_init(&iter, g);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        con_term_t *k = key, *v = value;
+        if (is_live && !is_live(k)) {
+            g_hash_table_iter_remove(&iter);
+            continue;
+        }
+        visit(&k);
+        visit(&v);
+        if (k != key) {
+            g_hash_table_iter_remove(&iter);
+            term_stack_push(&moved, k);
+            term_stack_push(&moved, v);
+        } else if (v != value) {
+            g_hash_table_iter_replace(&iter, v);
+        }
+    }
+    while (moved.size) {
+        con_term_t* v = term_stack_pop(&moved);
+        con_term_t* k = term_stack_pop(&moved);
+        g_hash_table_insert(g, k, v);
+    }
+    term_stack_destroy(&moved);
+}
+
+#ifdef CON_COMPRESSED_REFS
+// Pairs hold compressed references, so they are visited through a full
+// pointer, which is only written back if the visitor moved it
+void visit_ref(con_ref* r, slot_visitor visit) {
+    con_term_t* t = con_decompress(*r);
+    visit(&t);
+    if (con_compress(t) != *r) {
+        *r = con_compress(t);
+    }
+}
+#else
+#define visit_ref(r, visit) visit(r)
+#endif
+
+// Calls visit on every slot of t which refers to another term. Weak
+// slots are included, for the collectors which are not tracing through
+// them to update them.
+void visit_slots(con_term_t* t, slot_visitor visit) {
+    if (CON_IS_PAIR(t)) {
+        visit_ref(&CON_PAIR(t)->car, visit);
+        visit_ref(&CON_PAIR(t)->cdr, visit);
+        return;
+    }
+    switch (t->type) {
+        case LAMBDA:
+            visit(&t->value.lambda.vars);
+            visit(&t->value.lambda.body);
+            visit(&t->value.lambda.parent_env);
+            break;
+        case ENVIRONMENT:
+            visit(&t->value.env.parent);
+            visit_entries(t->value.env.table, NULL, visit);
+            break;
+        case WEAK_BOX:
+            visit(&t->value.weak);
+            break;
+        case EPHEMERON_TABLE:
+            visit_entries(t->value.ephemerons, NULL, visit);
+            break;
+        default:
+            break;
+    }
+}
+
+// Nursery terms which have been evacuated are left behind as FORWARDED,
+// pointing at their copy in the old generation. Pairs have no type, so
+// their car is set to a constant no pair holds otherwise and their cdr
+// points at the copy.
+#define PAIR_FORWARDED CON_CONST(FORWARDED)
+
+int is_forwarded(con_term_t* t) {
+    return CON_IS_PAIR(t) ? CAR(t) == PAIR_FORWARDED : t->type == FORWARDED;
+}
+
+con_term_t* forwarding(con_term_t* t) {
+    return CON_IS_PAIR(t) ? CDR(t) : t->value.forward;
+}
+
+// Not of a FORWARDED term, whose type is gone
+size_t term_size(con_term_t* t) {
+    return CON_IS_PAIR(t) ? sizeof(con_pair) : type_size(t->type);
+}
+
+// Copies a term into its pool and leaves it FORWARDED
+con_term_t* copy_term(con_term_t* t) {
+    con_term_t* copy;
+    if (CON_IS_PAIR(t)) {
+        copy = CON_PAIR_TERM(arena_pool_alloc(pools[PAIR_POOL]));
+        *CON_PAIR(copy) = *CON_PAIR(t);
+        SET_CAR(t, PAIR_FORWARDED);
+        SET_CDR(t, copy);
+    } else {
+        copy = arena_pool_alloc(pools[type_pool[t->type]]);
+        memcpy(copy, t, term_size(t));
+        if (needs_finalize(copy->type)) {
+            arena_set_finalize(copy);
+        }
+        t->type = FORWARDED;
+        t->value.forward = copy;
+    }
+    return copy;
+}
+
+con_term_t* promote(con_term_t* t) {
+    if (is_forwarded(t)) {
+        return forwarding(t);
+    }
+    con_term_t* copy = copy_term(t);
+    // Leaves have nothing to evacuate
+    if (CON_IS_PAIR(copy) || !arena_of(copy)->leaf) {
+        term_stack_push(&promoted, copy);
+    }
+    allocations_since_gc += 1;
+    bytes_since_gc += term_size(copy);
+    if (phase == GC_MARKING) {
+        shade(copy);
+    }
+    return copy;
+}
+
+void evacuate(con_term_t** slot) {
+    if (nursery_contains(young, *slot)) {
+        *slot = promote(*slot);
+    }
+}
+
+// How a collection treats weak references: whether a term survives it
+// so far, how to keep one alive, updating the slot if it moves, and how
+// to trace everything kept since the last drain.
+typedef struct {
+    int (*is_live)(con_term_t*);
+    slot_visitor keep;
+    void (*drain)();
+} weak_ops;
+
+// Drops the weak terms which died from the registry, and follows the
+// ones which moved
+void weak_terms_update(weak_ops* ops) {
+    size_t n = 0;
+    for (size_t i = 0; i < weak_terms.size; i++) {
+        con_term_t* t = weak_terms.items[i];
+        if (ops->is_live(t)) {
+            ops->keep(&t);
+            weak_terms.items[n++] = t;
+        }
+    }
+    weak_terms.size = n;
+}
+
+// Dead symbols are dropped from the intern table, and their names
+// released. The others follow their copy if they moved.
+void intern_update(weak_ops* ops) {
+    for (size_t i = 0; i < interned.capacity; i++) {
+        con_term_t** slot = &interned.slots[i];
+        if (!is_interned(*slot)) {
+            continue;
+        }
+        if (ops->is_live(*slot)) {
+            ops->keep(slot);
+        } else {
+            string_release(*slot);
+            *slot = TOMBSTONE;
+            interned.size--;
+            interned.tombstones++;
+        }
+    }
+    string_chunks_free_empty();
+}
+
+// Sampled pairs which died are forgotten by the heap profiler
+void profile_update(weak_ops* ops) {
+    if (profile_pairs) {
+        visit_entries(profile_pairs, ops->is_live, ops->keep);
+    }
+}
+
+// Called once everything strongly reachable has been kept. The values
+// of ephemerons with a live key are kept, which can make more keys live,
+// until nothing changes. Whatever is still not live is then cleared.
+void weak_process(weak_ops* ops) {
+    GHashTableIter iter;
+    gpointer key, value;
+    int progress = 1;
+
+    weak_terms_update(ops);
+    while (progress) {
+        progress = 0;
+        for (size_t i = 0; i < weak_terms.size; i++) {
+            con_term_t* t = weak_terms.items[i];
+            if (t->type != EPHEMERON_TABLE) {
+                continue;
+            }
+            g_hash_table_iter_init(&iter, t->value.ephemerons);
+            while (g_hash_table_iter_next(&iter, &key, &value)) {
+                con_term_t* v = value;
+                if (ops->is_live(key) && !ops->is_live(v)) {
+                    ops->keep(&v);
+                    progress = 1;
+                }
+            }
+        }
+        if (progress) {
+            ops->drain();
+        }
+    }
+    for (size_t i = 0; i < weak_terms.size; i++) {
+        con_term_t* t = weak_terms.items[i];
+        if (t->type == EPHEMERON_TABLE) {
+            visit_entries(t->value.ephemerons, ops->is_live, ops->keep);
+        } else if (ops->is_live(t->value.weak)) {
+            ops->keep(&t->value.weak);
+        } else {
+            t->value.weak = NULL;
+        }
+    }
+    intern_update(ops);
+    profile_update(ops);
+}
+
+// Minor collections treat weak references as strong ones, so weak terms
+// only need following to their copies
+int young_is_live(con_term_t* t) {
+    return !nursery_contains(young, t) || is_forwarded(t);
+}
+
+static weak_ops minor_weak_ops = {young_is_live, evacuate, NULL};
+
+void minor_gc() {
+    stats.minor_collections++;
+#ifdef GC_DEBUG
+    puts("\nMinor GC running.");
+    printf("There are %lu young bytes.\n", nursery_size(young));
+#endif
+    for (size_t i = 0; i < con_roots_size; i++) {
+        evacuate(con_roots[i]);
+    }
+    for (size_t i = 0; i < remembered.size; i++) {
+        con_term_t* t = remembered.items[i];
+        arena_forget(t);
+        visit_slots(t, evacuate);
+    }
+    remembered.size = 0;
+    // Everything reachable from a promoted term is promoted as well
+    while (promoted.size) {
+        visit_slots(term_stack_pop(&promoted), evacuate);
+    }
+    for (size_t i = 0; i < young_finalize.size; i++) {
+        con_term_t* t = young_finalize.items[i];
+        if (t->type != FORWARDED) {
+            finalize_enqueue(t);
+        }
+    }
+    young_finalize.size = 0;
+    weak_terms_update(&minor_weak_ops);
+    profile_update(&minor_weak_ops);
+    young->top = young->start;
+#ifdef GC_DEBUG
+    puts("Minor GC complete.");
+#endif
+}
+
+int major_gc_due() {
+    return allocations_since_gc >= gc_trigger;
+}
+
+// Called with the number of terms which survived a major gc
+void set_gc_trigger(size_t live) {
+    stats.live_objects = live;
+    gc_trigger = live * (gc_growth_factor - 1.0);
+    if (gc_trigger < gc_min_trigger) {
+        gc_trigger = gc_min_trigger;
+    }
+}
+
+void con_gc_set_growth_factor(double factor) {
+    gc_growth_factor = factor < 1.0 ? 1.0 : factor;
+}
+
+void con_gc_set_min_trigger(size_t allocations) {
+    gc_min_trigger = allocations;
+}
+
+void con_gc_set_retain_bytes(size_t bytes) {
+    gc_retain_bytes = bytes;
+}
+
+// Slots the marker traces through, which leaves out weak ones
+int has_slots(con_term_t* t) {
+    return CON_IS_PAIR(t) || t->type == LAMBDA || t->type == ENVIRONMENT;
+}
+
+// Immediates are not allocated at all
+int in_obj_pool(con_term_t* t) {
+    return !CON_IS_IMMEDIATE(t);
+}
+
+// Marks a term, returning 1 if it was white. Young terms are not part
+// of a major gc, they are shaded when they are promoted instead.
+int mark(con_term_t* t) {
+    if (!t || nursery_contains(young, t) || !in_obj_pool(t)) {
+        return 0;
+    }
+    return !arena_mark(t);
+}
+
+// Leaves are known to have no slots from their arena, without reading
+// the term
+int marked_has_slots(con_term_t* t) {
+    return CON_IS_PAIR(t) || (!arena_of(t)->leaf && has_slots(t));
+}
+
+void shade(con_term_t* t) {
+    // Terms without slots are black as soon as they are marked
+    if (mark(t) && marked_has_slots(t)) {
+        term_stack_push(&grey, t);
+    }
+}
+
+void shade_slot(con_term_t** slot) {
+    shade(*slot);
+}
+
+int arena_compare(const void* a, const void* b) {
+    uintptr_t x = *(uintptr_t*)a, y = *(uintptr_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Returns the allocated term w points into, if it is in any of the
+// sorted arenas
+con_term_t* arena_find_term(arena** arenas, size_t n, uintptr_t w) {
+    arena* a = arena_of((con_term_t*)w);
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (arenas[mid] < a) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == n || arenas[lo] != a || w < (uintptr_t)a->contents) {
+        return NULL;
+    }
+    // Pointers into the middle of a term keep it alive as well
+    size_t i = arena_index(a, (con_term_t*)w);
+    if (i >= a->capacity || !((a->alloc[i / 64] >> (i % 64)) & 1)) {
+        return NULL;
+    }
+    return arena_term(a, i);
+}
+
+// Appends the arenas of a pool to a snapshot
+size_t arena_pool_snapshot(arena_pool* p, arena** arenas, size_t n) {
+    memcpy(arenas + n, p->arenas, p->size * sizeof(*arenas));
+    return n + p->size;
+}
+
+// Shades every term the stack may refer to. Words outside the range of
+// the arenas are rejected before searching them. Returns the number of
+// words which referred to a term.
+__attribute__((noinline, no_sanitize_address))
+size_t scan_stack() {
+    // Spills the callee saved registers into this frame, above its locals
+    __builtin_unwind_init();
+    volatile uintptr_t bottom = (uintptr_t)&bottom;
+    size_t found = 0;
+
+    pools_lock();
+    arena** arenas = malloc((arena_count() + 1) * sizeof(*arenas));
+    size_t n = 0;
+    for (int i = 0; i < NUM_POOLS; i++) {
+        n = arena_pool_snapshot(pools[i], arenas, n);
+    }
+    pools_unlock();
+    qsort(arenas, n, sizeof(*arenas), arena_compare);
+
+    if (n) {
+        uintptr_t lo = (uintptr_t)arenas[0];
+        uintptr_t hi = (uintptr_t)arenas[n - 1] + ARENA_BYTES;
+        for (uintptr_t* p = (uintptr_t*)bottom; (uintptr_t)p < stack_top; p++) {
+            uintptr_t w = *p;
+            if (w < lo || w >= hi) {
+                continue;
+            }
+            con_term_t* t = arena_find_term(arenas, n, w);
+            if (t) {
+                shade(t);
+                found++;
+            }
+        }
+    }
+    free(arenas);
+    return found;
+}
+
+void shade_roots() {
+    for (size_t i = 0; i < con_roots_size; i++) {
+        shade(*con_roots[i]);
+    }
+    shade(con_alloc_site);
+    if (conservative) {
+        size_t found = scan_stack();
+#ifdef GC_DEBUG
+        printf("Found %lu conservative roots.\n", found);
+#else
+        (void)found;
+#endif
+    }
+}
+
+// Blackens a grey term. List spines are followed in a loop rather than
+// by pushing every cdr, which keeps the grey stack shallow on long
+// lists. After limit cells the rest of the spine is left grey. Returns
+// the number of terms scanned.
+size_t blacken(con_term_t* t, size_t limit) {
+    size_t n = 1;
+    while (CON_IS_PAIR(t)) {
+        con_term_t* next = CDR(t);
+        __builtin_prefetch(next);
+        shade(CAR(t));
+        if (!mark(next)) {
+            return n;
+        }
+        if (n++ == limit) {
+            term_stack_push(&grey, next);
+            return n;
+        }
+        t = next;
+    }
+    if (has_slots(t)) {
+        visit_slots(t, shade_slot);
+    }
+    return n;
+}
+
+long elapsed_nsec(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000L +
+        (now.tv_nsec - start->tv_nsec);
+}
+
+long elapsed_usec(struct timespec* start) {
+    return elapsed_nsec(start) / 1000L;
+}
+
+// Blackens terms until the grey stack is empty, or until the pause
+// budget runs out if a start time is given. Returns 1 once it is empty.
+int mark_grey(struct timespec* start) {
+    size_t limit = start ? GC_STEP_CHECK : SIZE_MAX;
+    size_t n = 0;
+    con_term_t* t;
+
+    while (grey.size) {
+        t = term_stack_pop(&grey);
+        if (grey.size) {
+            __builtin_prefetch(grey.items[grey.size - 1]);
+        }
+        n += blacken(t, limit);
+        if (start && n >= GC_STEP_CHECK) {
+            n = 0;
+            if (elapsed_usec(start) >= pause_budget) {
+                return !grey.size;
+            }
+        }
+    }
+    return 1;
+}
+
+// Parallel marking. The grey stack is dealt out to a pool of workers,
+// the calling thread being the first of them. Each one marks from a
+// private stack and moves half of it to its shared deque whenever that
+// has run dry, where idle workers can steal from. Mark bits are set
+// atomically, so a term is only ever blackened by one worker. Terms
+// are not written to, and neither are environment tables, since
+// shading never moves anything. It is off unless
+// con_gc_set_mark_threads asks for more than one thread, since it has
+// not been shown to scale yet.
+typedef struct {
+    size_t id;
+    pthread_t thread;
+    term_stack local;
+    pthread_mutex_t lock;
+    term_stack shared;
+    // shared.size, readable without taking the lock
+    size_t available;
+    // The last mark_epoch this worker has seen
+    size_t epoch;
+} mark_worker;
+
+static mark_worker* mark_workers = NULL;
+static size_t mark_threads = 1;
+
+static pthread_mutex_t mark_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mark_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t mark_done = PTHREAD_COND_INITIALIZER;
+// Bumped to start the workers on a new mark
+static size_t mark_epoch = 0;
+// Workers other than the caller which are still marking
+static size_t mark_running = 0;
+static int mark_exit = 0;
+// Workers which found nothing to mark, marking is over once it is all
+static size_t mark_idle = 0;
+
+static _Thread_local mark_worker* mark_self = NULL;
+
+int arena_mark_atomic(con_term_t* t) {
+    arena* a = arena_of(t);
+    size_t i = arena_index(a, t);
+    uint64_t bit = 1ULL << (i % 64);
+    if (__atomic_load_n(&a->marks[i / 64], __ATOMIC_RELAXED) & bit) {
+        return 1;
+    }
+    return (__atomic_fetch_or(&a->marks[i / 64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+int mark_atomic(con_term_t* t) {
+    if (!t || nursery_contains(young, t) || !in_obj_pool(t)) {
+        return 0;
+    }
+    return !arena_mark_atomic(t);
+}
+
+void parallel_shade(con_term_t* t) {
+    if (mark_atomic(t) && marked_has_slots(t)) {
+        term_stack_push(&mark_self->local, t);
+    }
+}
+
+void parallel_shade_slot(con_term_t** slot) {
+    parallel_shade(*slot);
+}
+
+void parallel_blacken(con_term_t* t) {
+    while (CON_IS_PAIR(t)) {
+        con_term_t* next = CDR(t);
+        __builtin_prefetch(next);
+        parallel_shade(CAR(t));
+        if (!mark_atomic(next)) {
+            return;
+        }
+        t = next;
+    }
+    if (has_slots(t)) {
+        visit_slots(t, parallel_shade_slot);
+    }
+}
+
+void mark_worker_share(mark_worker* w) {
+    pthread_mutex_lock(&w->lock);
+    for (size_t n = w->local.size / 2; n > 0; n--) {
+        term_stack_push(&w->shared, term_stack_pop(&w->local));
+    }
+    __atomic_store_n(&w->available, w->shared.size, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Takes half of the shared deque of w itself, or of the first other
+// worker which has anything. Returns 0 if there was nothing to take.
+int mark_worker_refill(mark_worker* w) {
+    for (size_t i = 0; i < mark_threads; i++) {
+        mark_worker* v = &mark_workers[(w->id + i) % mark_threads];
+        if (!__atomic_load_n(&v->available, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        pthread_mutex_lock(&v->lock);
+        for (size_t n = (v->shared.size + 1) / 2; n > 0; n--) {
+            term_stack_push(&w->local, term_stack_pop(&v->shared));
+        }
+        __atomic_store_n(&v->available, v->shared.size, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&v->lock);
+        if (w->local.size) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int mark_work_available() {
+    for (size_t i = 0; i < mark_threads; i++) {
+        if (__atomic_load_n(&mark_workers[i].available, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A worker only goes idle with an empty private stack after finding
+// every shared deque empty, and only busy workers share, so once all of
+// them are idle there is nothing left to mark.
+void mark_worker_run(mark_worker* w) {
+    mark_self = w;
+    while (1) {
+        while (w->local.size) {
+            parallel_blacken(term_stack_pop(&w->local));
+            if (w->local.size > MARK_SHARE_THRESHOLD &&
+                !__atomic_load_n(&w->available, __ATOMIC_RELAXED)) {
+                mark_worker_share(w);
+            }
+        }
+        if (mark_worker_refill(w)) {
+            continue;
+        }
+        __atomic_add_fetch(&mark_idle, 1, __ATOMIC_SEQ_CST);
+        while (!mark_work_available()) {
+            if (__atomic_load_n(&mark_idle, __ATOMIC_SEQ_CST) == mark_threads) {
+                return;
+            }
+            sched_yield();
+        }
+        __atomic_sub_fetch(&mark_idle, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void* mark_worker_main(void* arg) {
+    mark_worker* w = arg;
+
+    pthread_mutex_lock(&mark_lock);
+    while (1) {
+        while (mark_epoch == w->epoch && !mark_exit) {
+            pthread_cond_wait(&mark_start, &mark_lock);
+        }
+        if (mark_exit) {
+            break;
+        }
+        w->epoch = mark_epoch;
+        pthread_mutex_unlock(&mark_lock);
+        mark_worker_run(w);
+        pthread_mutex_lock(&mark_lock);
+        if (--mark_running == 0) {
+            pthread_cond_signal(&mark_done);
+        }
+    }
+    pthread_mutex_unlock(&mark_lock);
+    return NULL;
+}
+
+void parallel_mark() {
+    // Deal out the grey terms, and let the workers steal the rest
+    for (size_t i = 0; grey.size; i++) {
+        mark_worker* w = &mark_workers[i % mark_threads];
+        term_stack_push(&w->shared, term_stack_pop(&grey));
+        w->available = w->shared.size;
+    }
+    mark_idle = 0;
+
+    pthread_mutex_lock(&mark_lock);
+    mark_epoch++;
+    mark_running = mark_threads - 1;
+    pthread_cond_broadcast(&mark_start);
+    pthread_mutex_unlock(&mark_lock);
+
+    mark_worker_run(&mark_workers[0]);
+
+    pthread_mutex_lock(&mark_lock);
+    while (mark_running) {
+        pthread_cond_wait(&mark_done, &mark_lock);
+    }
+    pthread_mutex_unlock(&mark_lock);
+}
+
+void mark_workers_stop() {
+    pthread_mutex_lock(&mark_lock);
+    mark_exit = 1;
+    pthread_cond_broadcast(&mark_start);
+    pthread_mutex_unlock(&mark_lock);
+    for (size_t i = 0; i < mark_threads; i++) {
+        mark_worker* w = &mark_workers[i];
+        if (i > 0) {
+            pthread_join(w->thread, NULL);
+        }
+        pthread_mutex_destroy(&w->lock);
+        term_stack_destroy(&w->local);
+        term_stack_destroy(&w->shared);
+    }
+    free(mark_workers);
+    mark_workers = NULL;
+    mark_threads = 1;
+    mark_exit = 0;
+}
+
+void con_gc_set_mark_threads(int n) {
+    if (mark_workers) {
+        mark_workers_stop();
+    }
+    if (n <= 1) {
+        return;
+    }
+    mark_threads = n;
+    mark_workers = calloc(n, sizeof(*mark_workers));
+    for (size_t i = 0; i < mark_threads; i++) {
+        mark_worker* w = &mark_workers[i];
+        w->id = i;
+        w->epoch = mark_epoch;
+        pthread_mutex_init(&w->lock, NULL);
+        if (i > 0) {
+            pthread_create(&w->thread, NULL, mark_worker_main, w);
+        }
+    }
+}
+
+// Blackens everything reachable from the grey stack in one go
+void mark_all() {
+    if (mark_threads > 1) {
+        parallel_mark();
+    } else {
+        mark_grey(NULL);
+    }
+}
+
+void trace(con_term_t* t) {
+    shade(t);
+    mark_all();
+}
+
+// Whether a term has been marked by the collection which is finishing.
+// The nursery is empty by then.
+int marked_is_live(con_term_t* t) {
+    return !t || !in_obj_pool(t) || arena_is_marked(t);
+}
+
+static weak_ops mark_weak_ops = {marked_is_live, shade_slot, mark_all};
+
+// Mark bits left in unswept arenas belong to the last collection, so
+// they have to be swept before marking starts again.
+// Gives empty arenas above the retention watermark back to the OS,
+// once nothing is left to sweep
+void release_arenas() {
+    size_t retain = gc_retain_bytes / ARENA_BYTES;
+    size_t released = 0;
+    for (int i = 0; i < NUM_POOLS; i++) {
+        released += arena_pool_release(pools[i], retain);
+    }
+#ifdef GC_DEBUG
+    if (released) {
+        printf("Released %lu arenas.\n", released);
+    }
+#else
+    (void)released;
+#endif
+}
+
+void finish_sweep() {
+    for (int i = 0; i < NUM_POOLS; i++) {
+        arena_pool_sweep(pools[i]);
+    }
+    release_arenas();
+}
+
+// Called once marking is done, with what survived it
+void begin_sweep() {
+    size_t terms = 0;
+    live_bytes = 0;
+    for (int i = 0; i < NUM_POOLS; i++) {
+        size_t live = arena_pool_begin_sweep(pools[i]);
+        terms += live;
+        live_bytes += live << pools[i]->shift;
+    }
+    set_gc_trigger(terms);
+}
+
+// Whether the arenas are swept outside of the gc pause
+int sweep_deferred() {
+    return lazy_sweep || background_sweep;
+}
+
+void incremental_gc_start() {
+    stats.major_collections++;
+#ifdef GC_DEBUG
+    puts("\nIncremental GC starting.");
+#endif
+    if (nursery_size(young)) {
+        minor_gc();
+    }
+    finish_sweep();
+    allocations_since_gc = 0;
+    bytes_since_gc = 0;
+    phase = GC_MARKING;
+    shade_roots();
+}
+
+// The barrier keeps black terms from pointing at white ones, but the
+// roots and the nursery are not covered by it, so both are looked at
+// again before marking finishes in one go.
+void incremental_mark_finish() {
+#ifdef GC_DEBUG
+    puts("Incremental GC finishing mark.");
+#endif
+    if (nursery_size(young)) {
+        minor_gc();
+    }
+    shade_roots();
+    mark_all();
+    weak_process(&mark_weak_ops);
+    begin_sweep();
+    if (sweep_deferred()) {
+        phase = GC_IDLE;
+        return;
+    }
+    phase = GC_SWEEPING;
+}
+
+// Sweeps arenas until they are all done, or until the pause budget runs
+// out if a start time is given.
+// Allocation may sweep some of the arenas in between steps as well.
+void incremental_sweep(struct timespec* start) {
+    for (int i = 0; i < NUM_POOLS; i++) {
+        while (arena_pool_sweep_next(pools[i])) {
+            if (start && elapsed_usec(start) >= pause_budget) {
+                return;
+            }
+        }
+    }
+    release_arenas();
+#ifdef GC_DEBUG
+    puts("Incremental GC complete.");
+#endif
+    phase = GC_IDLE;
+}
+
+void incremental_gc_step() {
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    allocations_since_step = 0;
+    if (phase == GC_MARKING) {
+        if (!mark_grey(&start)) {
+            return;
+        }
+        incremental_mark_finish();
+    }
+    if (phase == GC_SWEEPING) {
+        incremental_sweep(&start);
+    }
+}
+
+void con_gc_set_pause_budget(long usec) {
+    pause_budget = usec;
+}
+
+void con_gc_set_lazy_sweep(int enabled) {
+    lazy_sweep = enabled;
+    if (!lazy_sweep) {
+        finish_sweep();
+    }
+}
+
+void con_gc_set_background_sweep(int enabled) {
+    background_sweep = enabled;
+    // Otherwise it is started by con_alloc_init
+    if (!pools[0]) {
+        return;
+    }
+    for (int i = 0; i < NUM_POOLS; i++) {
+        if (background_sweep) {
+            arena_pool_start_sweeper(pools[i]);
+        } else {
+            arena_pool_stop_sweeper(pools[i]);
+        }
+    }
+}
+
+void major_gc() {
+    stats.major_collections++;
+    // The nursery is empty from here on, so marking never has to look
+    // at young terms or the remembered set.
+    if (nursery_size(young)) {
+        minor_gc();
+    }
+    finish_sweep();
+    allocations_since_gc = 0;
+    bytes_since_gc = 0;
+#ifdef GC_DEBUG
+    puts("\nGC Running.");
+    printf("There are %lu roots.\n", count_roots());
+    puts("Marky mark");
+#endif
+    shade_roots();
+    mark_all();
+    weak_process(&mark_weak_ops);
+    begin_sweep();
+    if (sweep_deferred()) {
+        return;
+    }
+#ifdef GC_DEBUG
+    puts("Sweepy sweep.");
+#endif
+    finish_sweep();
+#ifdef GC_DEBUG
+    puts("GC run complete.");
+#endif
+}
+
+// Compaction is a Cheney style copy from the old arenas into new ones,
+// with the copied stack as the scan queue. Copying a list copies the
+// rest of its spine right behind it, so that walking it afterwards goes
+// through memory in order, and its cars follow in the same order when
+// they are scanned. Terms left behind are FORWARDED like the nursery's.
+con_term_t* compact_copy(con_term_t* t) {
+    con_term_t* copy = copy_term(t);
+    term_stack_push(&copied, copy);
+    live_bytes += term_size(copy);
+    return copy;
+}
+
+void compact_slot(con_term_t** slot) {
+    con_term_t* t = *slot;
+    if (!t || !in_obj_pool(t)) {
+        return;
+    }
+    if (is_forwarded(t)) {
+        *slot = forwarding(t);
+        return;
+    }
+    con_term_t* copy = compact_copy(t);
+    *slot = copy;
+    // The cdrs are left pointing at the old cells, every copy has its
+    // slots updated once it is scanned
+    while (CON_IS_PAIR(copy)) {
+        t = CDR(copy);
+        if (!t || !in_obj_pool(t) || is_forwarded(t)) {
+            break;
+        }
+        copy = compact_copy(t);
+    }
+}
+
+// Scans the copies which have not been scanned yet
+static size_t compact_scanned = 0;
+
+void compact_drain() {
+    while (compact_scanned < copied.size) {
+        con_term_t* t = copied.items[compact_scanned++];
+        if (has_slots(t)) {
+            visit_slots(t, compact_slot);
+        }
+    }
+}
+
+// Old terms are live once they have been copied
+int copied_is_live(con_term_t* t) {
+    return !t || !in_obj_pool(t) || is_forwarded(t);
+}
+
+static weak_ops compact_weak_ops = {copied_is_live, compact_slot, compact_drain};
+
+// Copies the names of the surviving symbols into fresh chunks and frees
+// the old ones, however few names were left in them
+void string_chunks_compact() {
+    string_chunk* old = string_chunks;
+
+    string_chunks = NULL;
+    for (size_t i = 0; i < interned.capacity; i++) {
+        con_term_t* t = interned.slots[i];
+        if (is_interned(t)) {
+            t->value.sym.str = string_alloc(t->value.sym.str, t->value.sym.size,
+                &t->value.sym.chunk);
+        }
+    }
+    string_chunks_destroy(old);
+}
+
+// Terms with a finalizer in the old arenas which were not copied are dead
+void compact_release(arena* a) {
+    for (int w = 0; w < a->capacity / 64; w++) {
+        uint64_t dead = a->finalize[w];
+        while (dead) {
+            con_term_t* t = arena_term(a, 64 * w + __builtin_ctzll(dead));
+            if (t->type != FORWARDED) {
+                finalize_enqueue(t);
+            }
+            dead &= dead - 1;
+        }
+    }
+    arena_destroy(a);
+}
+
+void compact_gc() {
+    // Terms found on the stack cannot be moved
+    if (conservative) {
+        major_gc();
+        return;
+    }
+    stats.compactions++;
+    if (nursery_size(young)) {
+        minor_gc();
+    }
+    finish_sweep();
+    allocations_since_gc = 0;
+    bytes_since_gc = 0;
+#ifdef GC_DEBUG
+    puts("\nGC Running, compacting.");
+    printf("There are %lu roots.\n", count_roots());
+#endif
+    size_t sizes[NUM_POOLS];
+    arena** from[NUM_POOLS];
+    for (int i = 0; i < NUM_POOLS; i++) {
+        from[i] = arena_pool_detach(pools[i], &sizes[i]);
+    }
+    live_bytes = 0;
+    for (size_t i = 0; i < con_roots_size; i++) {
+        compact_slot(con_roots[i]);
+    }
+    compact_slot(&con_alloc_site);
+    compact_drain();
+    weak_process(&compact_weak_ops);
+    string_chunks_compact();
+    set_gc_trigger(copied.size);
+    copied.size = 0;
+    compact_scanned = 0;
+    for (int i = 0; i < NUM_POOLS; i++) {
+        for (size_t j = 0; j < sizes[i]; j++) {
+            compact_release(from[i][j]);
+        }
+        free(from[i]);
+    }
+#ifdef GC_DEBUG
+    puts("GC run complete.");
+#endif
+}
+
+void con_gc_set_compacting(int enabled) {
+    compacting = enabled;
+}
+
+// Has to be called from the mutator's thread, at a safepoint.
+void con_gc_set_conservative(int enabled) {
+    pthread_attr_t attr;
+    void* addr;
+    size_t size;
+
+    conservative = enabled;
+    if (!conservative) {
+        return;
+    }
+    pthread_getattr_np(pthread_self(), &attr);
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    stack_top = (uintptr_t)addr + size;
+    // Young terms are moved when they are promoted
+    if (young && nursery_size(young)) {
+        minor_gc();
+    }
+}
+
+void record_pause(struct timespec* start) {
+    long nsec = elapsed_nsec(start);
+    int bucket = 0;
+    while (bucket < CON_GC_PAUSE_BUCKETS - 1 && nsec >= 1000L << bucket) {
+        bucket++;
+    }
+    stats.pause_histogram[bucket]++;
+    stats.pauses++;
+    pause_total_nsec += nsec;
+    if (nsec > pause_max_nsec) {
+        pause_max_nsec = nsec;
+    }
+}
+
+int gc_due() {
+    if (nursery_size(young) >= NURSERY_TRIGGER) {
+        return 1;
+    }
+    if (phase != GC_IDLE) {
+        return allocations_since_step >= GC_STEP_TRIGGER;
+    }
+    return major_gc_due();
+}
+
+void collect() {
+    if (nursery_size(young) >= NURSERY_TRIGGER) {
+        minor_gc();
+    }
+    if (phase != GC_IDLE) {
+        if (allocations_since_step >= GC_STEP_TRIGGER) {
+            incremental_gc_step();
+        }
+        return;
+    }
+    if (!major_gc_due()) {
+        return;
+    }
+    if (compacting) {
+        compact_gc();
+        return;
+    }
+    if (pause_budget > 0) {
+        incremental_gc_start();
+        incremental_gc_step();
+        return;
+    }
+    major_gc();
+}
+
+// The safepoint in eval. Only calls which do any collecting count as
+// pauses, finalizers run after the pause is over.
+void con_gc() {
+    struct timespec start;
+
+    if (gc_due()) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        collect();
+        record_pause(&start);
+    }
+    if (finalize_pending()) {
+        run_finalizers(FINALIZE_BATCH);
+    }
+    // See whether a major gc makes room before giving up
+    if (eval_abort && heap_limit && heap_used() > heap_limit) {
+        con_gc_major();
+        // The tables of dead environments are freed by their finalizers
+        con_gc_run_finalizers();
+        if (heap_used() > heap_limit) {
+            quota_exceeded("the heap limit");
+        }
+    }
+}
+
+// Finishes off an incremental collection which is underway
+void incremental_gc_finish() {
+    if (phase == GC_MARKING) {
+        incremental_mark_finish();
+    }
+    if (phase == GC_SWEEPING) {
+        incremental_sweep(NULL);
+    }
+}
+
+void con_gc_major() {
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    incremental_gc_finish();
+    if (compacting) {
+        compact_gc();
+    } else {
+        major_gc();
+    }
+    record_pause(&start);
+}
+
+void con_gc_compact() {
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    incremental_gc_finish();
+    compact_gc();
+    record_pause(&start);
+}
+
+void con_gc_stats(con_gc_stats_t* out) {
+    *out = stats;
+    out->pause_total_usec = pause_total_nsec / 1e3;
+    out->pause_max_usec = pause_max_nsec / 1e3;
+    out->external_bytes = external_bytes;
+    pools_lock();
+    out->arenas = arena_count();
+    pools_unlock();
+}
+
+// Estimated from the histogram, so this is the upper bound of the
+// bucket the percentile falls into
+double con_gc_pause_percentile(con_gc_stats_t* s, double percentile) {
+    size_t rank = s->pauses * percentile / 100.0, seen = 0;
+    for (int i = 0; i < CON_GC_PAUSE_BUCKETS; i++) {
+        seen += s->pause_histogram[i];
+        if (seen > rank) {
+            double bound = (double)(1L << i);
+            return bound < s->pause_max_usec ? bound : s->pause_max_usec;
+        }
+    }
+    return s->pause_max_usec;
+}
+
+typedef struct {
+    unsigned int site;
+    size_t count;
+} site_count;
+
+int site_count_compare(const void* a, const void* b) {
+    size_t x = ((site_count*)a)->count, y = ((site_count*)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Collects, then writes the live terms by type and, if profiling, by
+// the site they were allocated at. Returns the number of live terms.
+size_t con_heap_dump(FILE* out) {
+    size_t live = 0, types[CON_NUM_TYPES] = {0}, bytes[CON_NUM_TYPES] = {0};
+    site_count* sites = calloc(profile_sites_size + 1, sizeof(*sites));
+
+    con_gc_major();
+    finish_sweep();
+    for (size_t i = 0; i < profile_sites_size; i++) {
+        sites[i].site = i;
+    }
+    for (int p = 0; p < NUM_POOLS; p++) {
+        for (size_t i = 0; i < pools[p]->size; i++) {
+            arena* a = pools[p]->arenas[i];
+            for (int w = 0; w < a->capacity / 64; w++) {
+                for (uint64_t bits = a->alloc[w]; bits; bits &= bits - 1) {
+                    con_term_t* t = arena_term(a, 64 * w + __builtin_ctzll(bits));
+                    types[con_type_of(t)]++;
+                    bytes[con_type_of(t)] += term_size(t);
+                    if (!CON_IS_PAIR(t) && t->site) {
+                        sites[t->site].count++;
+                    }
+                    live++;
+                }
+            }
+        }
+    }
+    // Only the pairs which are still alive are left in the table
+    if (profile_pairs) {
+        GHashTableIter iter;
+        gpointer pair, site;
+        g_hash_table_iter_init(&iter, profile_pairs);
+        while (g_hash_table_iter_next(&iter, &pair, &site)) {
+            if (CON_FIXNUM_VALUE(site)) {
+                sites[CON_FIXNUM_VALUE(site)].count++;
+            }
+        }
+    }
+
+    size_t total = 0;
+    for (int type = 0; type < CON_NUM_TYPES; type++) {
+        total += bytes[type];
+    }
+    fprintf(out, "%zu live terms, %zu bytes in %zu arenas\n", live, total, arena_count());
+    for (int type = 0; type < CON_NUM_TYPES; type++) {
+        if (types[type]) {
+            fprintf(out, "  %-16s %12zu terms %14zu bytes\n", con_type_name(type),
+                types[type], bytes[type]);
+        }
+    }
+    if (profile_rate) {
+        fprintf(out, "By allocation site, sampled 1 in %zu:\n", profile_rate);
+        qsort(sites, profile_sites_size, sizeof(*sites), site_count_compare);
+        for (size_t i = 0; i < profile_sites_size && sites[i].count; i++) {
+            fprintf(out, "  %-16s %12zu terms\n", profile_sites[sites[i].site],
+                sites[i].count * profile_rate);
+        }
+    }
+    free(sites);
+    return live;
+}
+
+void con_write_barrier(con_term_t* obj, con_term_t* val) {
+    if (phase == GC_MARKING && !nursery_contains(young, obj) &&
+        arena_is_marked(obj)) {
+        shade(val);
+    }
+    if (nursery_contains(young, val) && !nursery_contains(young, obj)) {
+        remember(obj);
+    }
+}
+
+void con_roots_grow() {
+    con_roots_capacity = con_roots_capacity ? 2 * con_roots_capacity : 256;
+    con_roots = realloc(con_roots, con_roots_capacity * sizeof(*con_roots));
+}
+
+#ifdef GC_DEBUG
+void con_root(con_term_t **t) {
+    printf("Rooting object:   %p\n", (void*)(t));
+    if (con_roots_size == con_roots_capacity) {
+        con_roots_grow();
+    }
+    con_roots[con_roots_size++] = t;
+}
+
+void con_unroot(con_term_t **t) {
+    if (*t) {
+        printf("Unrooting object: %p\n", (void*)(t));
+    } else {
+        puts("Unrooting a currently NULL object.");
+    }
+    if (!con_roots_size || con_roots[con_roots_size - 1] != t) {
+        printf("FATAL: Unrooting %p out of order.\n", (void*)(t));
+        abort();
+    }
+    con_roots_size--;
+}
+#endif
+
+void destroy_roots() {
+    free(con_roots);
+    con_roots = NULL;
+    con_roots_size = con_roots_capacity = 0;
 }
@@ -5,7 +5,7 @@
 #include "con_alloc.h"
 
 con_term_t* builtin_cons(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 2) {
         printf("ERROR: Incorrect number of arguments, expected 2, got %zu.\n", length);
         return NULL;
@@ -14,13 +14,13 @@ con_term_t* builtin_cons(con_term_t* args) {
 }
 
 con_term_t* builtin_first(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 1) {
         printf("ERROR: Incorrect number of arguments, expected 1, got %zu.\n", length);
         return NULL;
     }
     con_term_t* l = CAR(args);
-    if (args->type != LIST) {
+    if (con_type_of(l) != LIST) {
         printf("ERROR: Expected list");
         return NULL;
     }
@@ -28,92 +28,121 @@ con_term_t* builtin_first(con_term_t* args) {
 }
 
 con_term_t* builtin_rest(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 1) {
         printf("ERROR: Incorrect number of arguments, expected 1, got %zu.\n", length);
         return NULL;
     }
     con_term_t* l = CAR(args);
-    if (args->type != LIST) {
+    if (con_type_of(l) != LIST) {
         printf("ERROR: Expected list");
         return NULL;
     }
     return CDR(l);
 }
 
+// Arithmetic with a flonum on either side is done on flonums, and so is
+// any fixnum arithmetic whose result does not fit in a fixnum
+int is_flonum_op(con_term_t* lhs, con_term_t* rhs) {
+    return con_type_of(lhs) == FLONUM || con_type_of(rhs) == FLONUM;
+}
+
+double to_flonum(con_term_t* t) {
+    return CON_IS_FIXNUM(t) ? CON_FIXNUM_VALUE(t) : con_flonum_value(t);
+}
+
 con_term_t* builtin_add(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 2) {
         printf("ERROR: Incorrect number of arguments, expected 2, got %zu.\n", length);
         return NULL;
     }
     con_term_t *lhs = CAR(args), *rhs = CAR(CDR(args)), *res = NULL;
-    res = con_alloc(FIXNUM);
-    res->value.fixnum = (lhs->value.fixnum) + (rhs->value.fixnum);
+    if (is_flonum_op(lhs, rhs)) {
+        return con_alloc_flonum(to_flonum(lhs) + to_flonum(rhs));
+    }
+    long l = CON_FIXNUM_VALUE(lhs), r = CON_FIXNUM_VALUE(rhs), n;
+    if (__builtin_add_overflow(l, r, &n)) {
+        return con_alloc_flonum((double)l + r);
+    }
+    res = con_alloc_fixnum(n);
     return res;
 }
 
 con_term_t* builtin_sub(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 2) {
         printf("ERROR: Incorrect number of arguments, expected 2, got %zu.", length);
         return NULL;
     }
     con_term_t *lhs = CAR(args), *rhs = CAR(CDR(args)), *res = NULL;
-    res = con_alloc(FIXNUM);
-    res->value.fixnum = (lhs->value.fixnum) - (rhs->value.fixnum);
+    if (is_flonum_op(lhs, rhs)) {
+        return con_alloc_flonum(to_flonum(lhs) - to_flonum(rhs));
+    }
+    long l = CON_FIXNUM_VALUE(lhs), r = CON_FIXNUM_VALUE(rhs), n;
+    if (__builtin_sub_overflow(l, r, &n)) {
+        return con_alloc_flonum((double)l - r);
+    }
+    res = con_alloc_fixnum(n);
     return res;
 }
 
 con_term_t* builtin_mul(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 2) {
         printf("ERROR: Incorrect number of arguments, expected 2, got %zu.", length);
         return NULL;
     }
     con_term_t *lhs = CAR(args), *rhs = CAR(CDR(args)), *res = NULL;
-    res = con_alloc(FIXNUM);
-    res->value.fixnum = (lhs->value.fixnum) * (rhs->value.fixnum);
+    if (is_flonum_op(lhs, rhs)) {
+        return con_alloc_flonum(to_flonum(lhs) * to_flonum(rhs));
+    }
+    long l = CON_FIXNUM_VALUE(lhs), r = CON_FIXNUM_VALUE(rhs), n;
+    if (__builtin_mul_overflow(l, r, &n)) {
+        return con_alloc_flonum((double)l * r);
+    }
+    res = con_alloc_fixnum(n);
     return res;
 }
 
 con_term_t* builtin_div(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 2) {
         printf("ERROR: Incorrect number of arguments, expected 2, got %zu.", length);
         return NULL;
     }
     con_term_t *lhs = CAR(args), *rhs = CAR(CDR(args)), *res = NULL;
-    if (rhs->value.fixnum == 0) {
-        printf("ERROR: Expected list");
+    if (is_flonum_op(lhs, rhs)) {
+        return con_alloc_flonum(to_flonum(lhs) / to_flonum(rhs));
+    }
+    if (CON_FIXNUM_VALUE(rhs) == 0) {
+        puts("ERROR: Division by zero.");
         return NULL;
     }
-    res = con_alloc(FIXNUM);
-    res->value.fixnum = (lhs->value.fixnum) + (rhs->value.fixnum);
+    // Truncates, and only -min / -1 can leave the fixnum range
+    res = con_alloc_fixnum(CON_FIXNUM_VALUE(lhs) / CON_FIXNUM_VALUE(rhs));
     return res;
 }
 
 con_term_t* builtin_equals(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 2) {
         printf("ERROR: Incorrect number of arguments, expected 2, got %zu.", length);
         return NULL;
     }
     con_term_t *lhs = CAR(args), *rhs = CAR(CDR(args));
-    if (lhs->type != rhs->type) {
+    if (con_type_of(lhs) != con_type_of(rhs)) {
         return con_alloc_false();
     }
     int result;
-    switch (lhs->type) {
+    switch (con_type_of(lhs)) {
         case FIXNUM:
-            result = lhs->value.fixnum == rhs->value.fixnum;
+            result = lhs == rhs;
             break;
         case FLONUM:
-            result = lhs->value.flonum == rhs->value.flonum;
+            result = con_flonum_value(lhs) == con_flonum_value(rhs);
             break;
         case EMPTY_LIST:
-            result = 1;
-            break;
         case SYMBOL:
         case BUILTIN:
         case LAMBDA:
@@ -130,7 +159,7 @@ con_term_t* builtin_equals(con_term_t* args) {
 }
 
 con_term_t* builtin_is(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 2) {
         printf("ERROR: Incorrect number of arguments, expected 2, got %zu.", length);
         return NULL;
@@ -140,17 +169,17 @@ con_term_t* builtin_is(con_term_t* args) {
 }
 
 con_term_t* builtin_less_than(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 2) {
         printf("ERROR: Incorrect number of arguments, expected 2, got %zu.", length);
         return NULL;
     }
     con_term_t *lhs = CAR(args), *rhs = CAR(CDR(args));
-    if (lhs->type == rhs->type) {
-        if (lhs->type == FIXNUM) {
-            return lhs->value.fixnum < rhs->value.fixnum ? con_alloc_true() : con_alloc_false();
-        } else if (lhs->type == FLONUM) {
-            return lhs->value.flonum < rhs->value.flonum ? con_alloc_true() : con_alloc_false();
+    if (con_type_of(lhs) == con_type_of(rhs)) {
+        if (CON_IS_FIXNUM(lhs)) {
+            return CON_FIXNUM_VALUE(lhs) < CON_FIXNUM_VALUE(rhs) ? con_alloc_true() : con_alloc_false();
+        } else if (con_type_of(lhs) == FLONUM) {
+            return con_flonum_value(lhs) < con_flonum_value(rhs) ? con_alloc_true() : con_alloc_false();
         }
     }
     printf("ERROR: Cannot compare arguments.");
@@ -158,23 +187,138 @@ con_term_t* builtin_less_than(con_term_t* args) {
 }
 
 con_term_t* builtin_greater_than(con_term_t* args) {
-    size_t length = args->value.list.length;
+    size_t length = con_list_length(args);
     if (length != 2) {
         printf("ERROR: Incorrect number of arguments, expected 2, got %zu.", length);
         return NULL;
     }
     con_term_t *lhs = CAR(args), *rhs = CADR(args);
-    if (lhs->type == rhs->type) {
-        if (lhs->type == FIXNUM) {
-            return lhs->value.fixnum > rhs->value.fixnum ? con_alloc_true() : con_alloc_false();
-        } else if (lhs->type == FLONUM) {
-            return lhs->value.flonum > rhs->value.flonum ? con_alloc_true() : con_alloc_false();
+    if (con_type_of(lhs) == con_type_of(rhs)) {
+        if (CON_IS_FIXNUM(lhs)) {
+            return CON_FIXNUM_VALUE(lhs) > CON_FIXNUM_VALUE(rhs) ? con_alloc_true() : con_alloc_false();
+        } else if (con_type_of(lhs) == FLONUM) {
+            return con_flonum_value(lhs) > con_flonum_value(rhs) ? con_alloc_true() : con_alloc_false();
         }
     }
     printf("ERROR: Cannot compare arguments.");
     return NULL;
 }
 
+// Prepends (name . value) to an association list
+con_term_t* alist_push(con_term_t* alist, char* name, con_term_t* value) {
+    return cons(cons(con_alloc_sym(name), value), alist);
+}
+
+con_term_t* builtin_gc_stats(con_term_t* args) {
+    size_t length = con_list_length(args);
+    if (length != 0) {
+        printf("ERROR: Incorrect number of arguments, expected 0, got %zu.\n", length);
+        return NULL;
+    }
+    con_gc_stats_t s;
+    con_gc_stats(&s);
+
+    // Built back to front
+    con_term_t *allocated = con_alloc_empty_list(), *bytes = con_alloc_empty_list();
+    for (int type = CON_NUM_TYPES - 1; type >= 0; type--) {
+        if (s.allocated[type]) {
+            allocated = alist_push(allocated, con_type_name(type), con_alloc_fixnum(s.allocated[type]));
+            bytes = alist_push(bytes, con_type_name(type), con_alloc_fixnum(s.bytes_allocated[type]));
+        }
+    }
+    con_term_t* stats = con_alloc_empty_list();
+    stats = alist_push(stats, "external-bytes", con_alloc_fixnum(s.external_bytes));
+    stats = alist_push(stats, "arenas", con_alloc_fixnum(s.arenas));
+    stats = alist_push(stats, "evals-abandoned", con_alloc_fixnum(s.evals_abandoned));
+    stats = alist_push(stats, "finalized", con_alloc_fixnum(s.finalized));
+    stats = alist_push(stats, "live-objects", con_alloc_fixnum(s.live_objects));
+    stats = alist_push(stats, "bytes-allocated", bytes);
+    stats = alist_push(stats, "allocated", allocated);
+    stats = alist_push(stats, "pause-p99-usec", con_alloc_fixnum(con_gc_pause_percentile(&s, 99)));
+    stats = alist_push(stats, "pause-p90-usec", con_alloc_fixnum(con_gc_pause_percentile(&s, 90)));
+    stats = alist_push(stats, "pause-p50-usec", con_alloc_fixnum(con_gc_pause_percentile(&s, 50)));
+    stats = alist_push(stats, "pause-max-usec", con_alloc_fixnum(s.pause_max_usec));
+    stats = alist_push(stats, "pause-total-usec", con_alloc_fixnum(s.pause_total_usec));
+    stats = alist_push(stats, "pauses", con_alloc_fixnum(s.pauses));
+    stats = alist_push(stats, "compactions", con_alloc_fixnum(s.compactions));
+    stats = alist_push(stats, "major-collections", con_alloc_fixnum(s.major_collections));
+    stats = alist_push(stats, "minor-collections", con_alloc_fixnum(s.minor_collections));
+    return stats;
+}
+
+con_term_t* builtin_heap_dump(con_term_t* args) {
+    size_t length = con_list_length(args);
+    if (length != 0) {
+        printf("ERROR: Incorrect number of arguments, expected 0, got %zu.\n", length);
+        return NULL;
+    }
+    return con_alloc_fixnum(con_heap_dump(stdout));
+}
+
+con_term_t* builtin_make_weak_box(con_term_t* args) {
+    size_t length = con_list_length(args);
+    if (length != 1) {
+        printf("ERROR: Incorrect number of arguments, expected 1, got %zu.\n", length);
+        return NULL;
+    }
+    return con_alloc_weak_box(CAR(args));
+}
+
+// The boxed value, or false once it has been collected
+con_term_t* builtin_weak_box_value(con_term_t* args) {
+    size_t length = con_list_length(args);
+    if (length != 1) {
+        printf("ERROR: Incorrect number of arguments, expected 1, got %zu.\n", length);
+        return NULL;
+    }
+    con_term_t* box = CAR(args);
+    if (con_type_of(box) != WEAK_BOX) {
+        puts("ERROR: Expected a weak box.");
+        return NULL;
+    }
+    return box->value.weak ? box->value.weak : con_alloc_false();
+}
+
+con_term_t* builtin_make_ephemeron_table(con_term_t* args) {
+    size_t length = con_list_length(args);
+    if (length != 0) {
+        printf("ERROR: Incorrect number of arguments, expected 0, got %zu.\n", length);
+        return NULL;
+    }
+    return con_alloc_ephemeron_table();
+}
+
+con_term_t* builtin_ephemeron_set(con_term_t* args) {
+    size_t length = con_list_length(args);
+    if (length != 3) {
+        printf("ERROR: Incorrect number of arguments, expected 3, got %zu.\n", length);
+        return NULL;
+    }
+    con_term_t* table = CAR(args);
+    if (con_type_of(table) != EPHEMERON_TABLE) {
+        puts("ERROR: Expected an ephemeron table.");
+        return NULL;
+    }
+    con_ephemeron_set(table, CADR(args), CADDR(args));
+    return CADDR(args);
+}
+
+// The value stored under the key, or false if there is none
+con_term_t* builtin_ephemeron_ref(con_term_t* args) {
+    size_t length = con_list_length(args);
+    if (length != 2) {
+        printf("ERROR: Incorrect number of arguments, expected 2, got %zu.\n", length);
+        return NULL;
+    }
+    con_term_t* table = CAR(args);
+    if (con_type_of(table) != EPHEMERON_TABLE) {
+        puts("ERROR: Expected an ephemeron table.");
+        return NULL;
+    }
+    con_term_t* value = con_ephemeron_ref(table, CADR(args));
+    return value ? value : con_alloc_false();
+}
+
 void con_env_add_builtin(con_term_t* env, char* s, con_builtin builtin) {
     con_term_t* f = con_alloc(BUILTIN);
     con_term_t* sym = con_alloc_sym(s);
@@ -200,5 +344,16 @@ void con_env_add_builtins(con_term_t* env) {
     con_env_add_builtin(env, "=", builtin_equals);
     con_env_add_builtin(env, "<", builtin_less_than);
     con_env_add_builtin(env, ">", builtin_greater_than);
+
+    // Garbage collection
+    con_env_add_builtin(env, "gc-stats", builtin_gc_stats);
+    con_env_add_builtin(env, "heap-dump", builtin_heap_dump);
+
+    // Weak references
+    con_env_add_builtin(env, "make-weak-box", builtin_make_weak_box);
+    con_env_add_builtin(env, "weak-box-value", builtin_weak_box_value);
+    con_env_add_builtin(env, "make-ephemeron-table", builtin_make_ephemeron_table);
+    con_env_add_builtin(env, "ephemeron-set!", builtin_ephemeron_set);
+    con_env_add_builtin(env, "ephemeron-ref", builtin_ephemeron_ref);
 }
 
@@ -1,3 +1,6 @@
+#include <errno.h>
+#include <stdlib.h>
+
 #include "con_term.h"
 #include "con_parse.h"
 #include "con_alloc.h"
@@ -108,11 +111,12 @@ con_term_t* mpc_ast_to_term(mpc_ast_t* t) {
         t = t->children[1];
         term = con_alloc_pair(con_alloc_sym("quote"), mpc_ast_to_term(t));
     } else if (strstr(t->tag, "fixnum")) {
-        term = con_alloc(FIXNUM);
-        term->value.fixnum = atoi(t->contents);
+        // Literals too big for a fixnum are read as flonums
+        errno = 0;
+        long n = strtol(t->contents, NULL, 10);
+        term = errno == ERANGE ? con_alloc_flonum(atof(t->contents)) : con_alloc_fixnum(n);
     } else if (strstr(t->tag, "flonum")) {
-        term = con_alloc(FLONUM);
-        term->value.flonum = atof(t->contents);
+        term = con_alloc_flonum(atof(t->contents));
     } else if (strstr(t->tag, "symbol")) {
         term = con_alloc_sym(t->contents);
     } else if (strstr(t->tag, "list")) {
@@ -133,16 +137,11 @@ con_term_t* mpc_ast_to_list(mpc_ast_t* t) {
         list = mpc_ast_to_term(t->children[i]);
         i = n - 4;
     } else {
-        list = con_alloc(EMPTY_LIST);
+        list = con_alloc_empty_list();
     }
 
-    size_t length = 0;
     while (i > 0) {
-        con_term_t* next = con_alloc(LIST);
-        CAR(next) = mpc_ast_to_term(t->children[i]);
-        CDR(next) = list;
-        next->value.list.length = (++length);
-        list = next;
+        list = cons(mpc_ast_to_term(t->children[i]), list);
         i--;
     }
     return list;
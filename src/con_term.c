@@ -4,9 +4,29 @@
 #include "con_term.h"
 #include "con_alloc.h"
 
+char* con_type_name(CON_TYPE type) {
+    switch (type) {
+        case FIXNUM:      return "fixnum";
+        case FLONUM:      return "flonum";
+        case LIST:        return "list";
+        case SYMBOL:      return "symbol";
+        case EMPTY_LIST:  return "empty-list";
+        case BUILTIN:     return "builtin";
+        case CON_TRUE:    return "true";
+        case CON_FALSE:   return "false";
+        case ENVIRONMENT: return "environment";
+        case UNDEFINED:   return "undefined";
+        case LAMBDA:      return "lambda";
+        case WEAK_BOX:    return "weak-box";
+        case EPHEMERON_TABLE: return "ephemeron-table";
+        case FORWARDED:   return "forwarded";
+    }
+    return "???";
+}
+
 void con_term_print_pair(con_term_t* t) {
     con_term_print(CAR(t));
-    switch (CDR(t)->type) {
+    switch (con_type_of(CDR(t))) {
         case EMPTY_LIST:
             break;
         case LIST:
@@ -25,12 +45,12 @@ void con_term_print(con_term_t* t) {
     // Also when sweeping an arena, although I think
     // that is because the type was not reset somehow
     // and it was still trying to print it.
-    switch (t->type) {
+    switch (con_type_of(t)) {
         case FLONUM:
-            printf("%f", t->value.flonum);
+            printf("%f", con_flonum_value(t));
             break;
         case FIXNUM:
-            printf("%ld", t->value.fixnum);
+            printf("%ld", CON_FIXNUM_VALUE(t));
             break;
         case SYMBOL:
             printf("%s", t->value.sym.str);
@@ -58,6 +78,12 @@ void con_term_print(con_term_t* t) {
         case ENVIRONMENT:
             printf("<environment>");
             break;
+        case WEAK_BOX:
+            printf("<weak-box>");
+            break;
+        case EPHEMERON_TABLE:
+            printf("<ephemeron-table>");
+            break;
         default:
             printf("???");
     }
@@ -72,33 +98,59 @@ void con_term_print_message(char* msg, con_term_t* t) {
     puts("");
 }
 
+// Environments are keyed by the symbol itself, since symbols are interned
+guint symbol_hash(gconstpointer sym) {
+    return ((con_term_t*)sym)->value.sym.hash;
+}
+
+// Roughly what glib takes for a table with its first buckets, and for a
+// key, value and hash per binding at the load it resizes at. Charged to
+// the collector, which only sees the environment term itself.
+#define ENV_TABLE_BYTES 256
+#define ENV_BINDING_BYTES 48
+
 void con_env_init(con_term_t* t, con_term_t* parent) {
-    GHashTable* table = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTable* table = g_hash_table_new(symbol_hash, g_direct_equal);
     t->value.env.parent = parent;
     t->value.env.table = table;
+    con_gc_external_alloc(ENV_TABLE_BYTES);
 }
 
 void con_env_deinit(con_term_t* t) {
+    con_gc_external_free(ENV_TABLE_BYTES +
+        g_hash_table_size(t->value.env.table) * ENV_BINDING_BYTES);
     g_hash_table_destroy(t->value.env.table);
 }
 
 int con_env_bind(con_term_t* t, con_term_t* sym, con_term_t* val) {
-    return g_hash_table_insert(t->value.env.table, sym->value.sym.str, val);
+    con_write_barrier(t, sym);
+    con_write_barrier(t, val);
+    int added = g_hash_table_insert(t->value.env.table, sym, val);
+    if (added) {
+        con_gc_external_alloc(ENV_BINDING_BYTES);
+    }
+    return added;
 }
 
 con_term_t* con_env_lookup(con_term_t* t, con_term_t* sym) {
     con_term_t* val;
     do {
-        val = g_hash_table_lookup(t->value.env.table, sym->value.sym.str);
+        val = g_hash_table_lookup(t->value.env.table, sym);
         t = t->value.env.parent;
     } while(!val && t);
     return val;
 }
 
-inline con_term_t* cons(con_term_t* first, con_term_t* rest) {
-    con_term_t* pair = con_alloc(LIST);
-    CAR(pair) = first;
-    CDR(pair) = rest;
+con_term_t* cons(con_term_t* first, con_term_t* rest) {
+    return con_alloc_cons(first, rest);
+}
 
-    return pair;
+// Lists do not keep their length, so it is counted
+size_t con_list_length(con_term_t* t) {
+    size_t length = 0;
+    while (CON_IS_PAIR(t)) {
+        length++;
+        t = CDR(t);
+    }
+    return length;
 }
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <setjmp.h>
 
 #include <editline/readline.h>
 
@@ -26,41 +27,62 @@ void init_keywords() {
     keywords[KWD_LAMBDA] = con_alloc_sym("lambda");
     keywords[KWD_LET]    = con_alloc_sym("let");
     keywords[KWD_IF]     = con_alloc_sym("if");
+    // Symbols are collected like anything else, and eval compares
+    // against these by identity
+    for (int i = 0; i < NUM_KEYWORDS; i++) {
+        con_root(&keywords[i]);
+    }
 }
 
-con_term_t current_thunk;
+con_pair current_thunk;
 
 con_term_t* eval(con_term_t* env, con_term_t* list);
 con_term_t* thunk(con_term_t* env, con_term_t* code);
 
 con_term_t* eval_args(con_term_t* env, con_term_t* list) {
-    // Create the evaluated args by reversing and evaluating
-    con_term_t *args = NULL, **a = &args;
-    size_t length = list->value.list.length;
+    // Create the evaluated args by appending to the tail of the list.
+    // Anything held across eval may be moved by the collector, so it
+    // all has to be rooted.
+    con_term_t *args = NULL, *tail = NULL, *cell;
 
-    con_root(&args);
+    con_root(&env);
     con_root(&list);
-    CON_LIST_FOREACH(entry, list) {
-        // FIXME: I think the issue is here. We allocate a list
-        // and somehow during the trace it goes boom
-        *a = con_alloc(LIST);
-        CAR(*a) = NULL;
-        CDR(*a) = NULL;
-        CAR(*a) = eval(env, entry);
-        (*a)->value.list.length = length--;
-        a = &CDR(*a);
+    con_root(&args);
+    con_root(&tail);
+    while (CON_IS_PAIR(list)) {
+        cell = cons(eval(env, CAR(list)), NULL);
+        if (tail) {
+            SET_CDR(tail, cell);
+            con_write_barrier(tail, cell);
+        } else {
+            args = cell;
+        }
+        tail = cell;
+        list = CDR(list);
     }
-    *a = con_alloc(EMPTY_LIST);
-    con_unroot(&list);
+    cell = con_alloc_empty_list();
+    if (tail) {
+        SET_CDR(tail, cell);
+        con_write_barrier(tail, cell);
+    } else {
+        args = cell;
+    }
+    con_unroot(&tail);
     con_unroot(&args);
+    con_unroot(&list);
+    con_unroot(&env);
     return args;
 }
 
 void eval_define(con_term_t* env, con_term_t* t) {
     con_term_t* val = NULL;
-    if (t->value.list.length == 2 && CAR(t)->type == SYMBOL) {
+    if (con_list_length(t) == 2 && con_type_of(CAR(t)) == SYMBOL) {
+        con_root(&env);
+        con_root(&t);
         val = eval(env, CADR(t));
-    } else if (t->value.list.length >= 2 && CAR(t)->type == LIST) {
+        con_unroot(&t);
+        con_unroot(&env);
+    } else if (con_list_length(t) >= 2 && con_type_of(CAR(t)) == LIST) {
         con_term_t* vars = CDR(CAR(t));
         con_term_t* body = CADR(t);
         t = CAR(t);
@@ -77,13 +99,13 @@ void eval_define(con_term_t* env, con_term_t* t) {
 }
 
 con_term_t* eval_lambda(con_term_t* env, con_term_t* t) {
-    if (t->value.list.length != 2) {
+    if (con_list_length(t) != 2) {
         puts("ERROR: Invalid lambda form.");
         return NULL;
     }
     con_term_t* vars = CAR(t);
     con_term_t* body = CADR(t);
-    if (vars->type != LIST && vars->type != EMPTY_LIST) {
+    if (con_type_of(vars) != LIST && con_type_of(vars) != EMPTY_LIST) {
         puts("ERROR: Invalid lambda form, variables must be a list.");
         return NULL;
     }
@@ -98,15 +120,15 @@ con_term_t* eval_lambda(con_term_t* env, con_term_t* t) {
 con_term_t* eval_lambda_call(con_term_t* lambda, con_term_t* args) {
     con_term_t* inner = con_alloc_env(lambda->value.lambda.parent_env);
     con_term_t* vars  = lambda->value.lambda.vars;
-    int arity         = vars->value.list.length;
-    int length        = args->value.list.length;
+    int arity         = con_list_length(vars);
+    int length        = con_list_length(args);
     if (length != arity) {
         printf("ERROR: Expected %d arguments, got %d.\n", arity, length);
         return NULL;
     }
     // Create the bindings in the lambda
     con_term_t *v, *b;
-    while (vars->type != EMPTY_LIST) {
+    while (CON_IS_PAIR(vars)) {
         v = CAR(vars);
         b = CAR(args);
         con_env_bind(inner, v, b);
@@ -117,12 +139,12 @@ con_term_t* eval_lambda_call(con_term_t* lambda, con_term_t* args) {
 }
 
 con_term_t* eval_let(con_term_t* env, con_term_t* t) {
-    if (t->value.list.length != 2) {
+    if (con_list_length(t) != 2) {
         puts("ERROR: Invalid let form.");
         return NULL;
     }
-    con_term_t* vars = con_alloc(EMPTY_LIST);
-    con_term_t* args = con_alloc(EMPTY_LIST);
+    con_term_t* vars = con_alloc_empty_list();
+    con_term_t* args = con_alloc_empty_list();
     CON_LIST_FOREACH(entry, CAR(t)) {
         vars = cons(CAR(entry), vars);
         args = cons(CADR(entry), args);
@@ -131,7 +153,9 @@ con_term_t* eval_let(con_term_t* env, con_term_t* t) {
     lambda->value.lambda.parent_env = env;
     lambda->value.lambda.vars = vars;
     lambda->value.lambda.body = CADR(t);
+    con_root(&lambda);
     args = eval_args(env, args);
+    con_unroot(&lambda);
     return eval_lambda_call(lambda, args);
 }
 
@@ -147,28 +171,37 @@ con_term_t* eval_list_trampoline(con_term_t* env, con_term_t* t) {
     } else if (first == keywords[KWD_LAMBDA]) {
         return eval_lambda(env, t);
     } else if (first == keywords[KWD_IF]) {
-        if (t->value.list.length != 3) {
+        if (con_list_length(t) != 3) {
             puts("ERROR: Invalid 'if' form.");
             return NULL;
         }
         con_term_t *cond, *body, *res;
         cond = CAR(t);
+        con_root(&env);
+        con_root(&t);
+        res = eval(env, cond);
+        con_unroot(&t);
+        con_unroot(&env);
         // Initialize body to false
         body = CADDR(t);
-        res = eval(env, cond);
-        if (res && res->type == CON_TRUE) {
+        if (res && con_type_of(res) == CON_TRUE) {
             body = CADR(t);
         }
         return eval(env, body);
     } else {
-        con_term_t *args = eval_args(env, t), *func;
-        // Need to root args here since evaluating the func can be bad.
+        con_term_t *args = NULL, *func;
+        con_root(&env);
+        con_root(&first);
         con_root(&args);
+        args = eval_args(env, t);
+        // Need to root args here since evaluating the func can be bad.
         func = eval(env, first);
         con_unroot(&args);
-        if (func && func->type == BUILTIN) {
+        con_unroot(&first);
+        con_unroot(&env);
+        if (func && con_type_of(func) == BUILTIN) {
             return func->value.builtin(args);
-        } else if (func && func->type == LAMBDA) {
+        } else if (func && con_type_of(func) == LAMBDA) {
             return eval_lambda_call(func, args);
         } else {
             puts("ERROR: First element of list must be a function");
@@ -178,31 +211,49 @@ con_term_t* eval_list_trampoline(con_term_t* env, con_term_t* t) {
     return NULL;
 }
 
+// The allocation site of everything allocated while evaluating a form
+con_term_t* form_site(con_term_t* t) {
+    return con_type_of(CAR(t)) == SYMBOL ? CAR(t) : NULL;
+}
+
 con_term_t* eval_list(con_term_t* env, con_term_t* t) {
-    con_term_t* result = eval_list_trampoline(env, t);
-    while (result == &current_thunk) {
-        env = CAR(&current_thunk);
-        t   = CDR(&current_thunk);
-        con_root(&env);
+    con_term_t* result;
+    con_term_t* site = con_alloc_site;
+    // Symbols move when the heap is compacted
+    con_root(&site);
+    con_root(&env);
+    con_root(&t);
+    con_alloc_site = form_site(t);
+    result = eval_list_trampoline(env, t);
+    while (result == CON_PAIR_TERM(&current_thunk)) {
+        env = con_decompress(current_thunk.car);
+        t   = con_decompress(current_thunk.cdr);
+        con_alloc_site = form_site(t);
         result = eval_list_trampoline(env, t);
-        con_unroot(&env);
     }
+    con_unroot(&t);
+    con_unroot(&env);
+    con_unroot(&site);
+    con_alloc_site = site;
     return result;
 }
 
 con_term_t* thunk(con_term_t* env, con_term_t* code) {
-    if (code->type != LIST) {
+    if (con_type_of(code) != LIST) {
         return eval(env, code);
     }
-    current_thunk.type = LIST;
-    CAR(&current_thunk) = env;
-    CDR(&current_thunk) = code;
-    return &current_thunk;
+    current_thunk.car = con_compress(env);
+    current_thunk.cdr = con_compress(code);
+    return CON_PAIR_TERM(&current_thunk);
 }
 
 con_term_t* eval(con_term_t* env, con_term_t* t) {
+    con_root(&env);
+    con_root(&t);
     con_gc();
-    if (t->type == SYMBOL) {
+    con_unroot(&t);
+    con_unroot(&env);
+    if (con_type_of(t) == SYMBOL) {
         // resolve a lookup
         con_term_t* value;
         if ((value = con_env_lookup(env, t))) {
@@ -214,7 +265,7 @@ con_term_t* eval(con_term_t* env, con_term_t* t) {
             return NULL;
         }
         return NULL;
-    } else if (t->type != LIST) {
+    } else if (con_type_of(t) != LIST) {
         return t;
     }
     return eval_list(env, t);
@@ -238,25 +289,37 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
-    con_term_t* term = NULL;
+    // The collector moves these through their roots, and going over a
+    // quota longjmps back past that, so they cannot be automatic
+    static con_term_t* term = NULL;
+    static con_term_t* global_env = NULL;
     con_parser_t* parser = con_parser_init();
 
     con_alloc_init();
-    con_term_t* global_env = con_alloc_env(NULL);
+    global_env = con_alloc_env(NULL);
     con_root(&global_env);
     con_root(&term);
     con_env_add_builtins(global_env);
     init_keywords();
 
     char* input = NULL;
+    jmp_buf abandon;
     while (1) {
         input = readline("con> ");
         if (!done) {
             add_history(input);
             if ((term = con_parser_parse(parser, "<stdin>", input))) {
-                if ((term = eval(global_env, term))) {
-                    con_term_print(term);
-                    puts("");
+                // Going over a quota comes back here with an error printed
+                if (!setjmp(abandon)) {
+                    con_eval_begin(&abandon);
+                    term = eval(global_env, term);
+                    con_eval_end();
+                    if (term) {
+                        con_term_print(term);
+                        puts("");
+                    }
+                } else {
+                    term = NULL;
                 }
             }
             free(input);